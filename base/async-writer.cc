@@ -0,0 +1,92 @@
+#include "base/async-writer.h"
+
+#include <cerrno>
+#include <utility>
+
+#include <poll.h>
+#include <unistd.h>
+
+AsyncWriter::AsyncWriter(int fd, std::function<void(size_t)> on_write)
+    : fd_(fd),
+      on_write_(std::move(on_write)),
+      stop_(false),
+      queued_bytes_(0),
+      failed_(false),
+      thread_(&AsyncWriter::Run, this) {}
+
+AsyncWriter::~AsyncWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+}
+
+void AsyncWriter::Write(const void* data, size_t size) {
+  if (!size) return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (failed_) return;
+    queued_.append(static_cast<const char*>(data), size);
+    queued_bytes_ += size;
+  }
+  cond_.notify_one();
+}
+
+void AsyncWriter::WaitForQueued(size_t size) {
+  if (queued_bytes_ <= size) return;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  drained_.wait(lock, [this, size] { return queued_bytes_ <= size; });
+}
+
+void AsyncWriter::Run() {
+  std::string writing;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+      if (queued_.empty()) return;
+      writing.swap(queued_);
+    }
+
+    for (size_t offset = 0; offset < writing.size();) {
+      const ssize_t result =
+          write(fd_, &writing[offset], writing.size() - offset);
+
+      if (result < 0) {
+        if (errno == EINTR) continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          struct pollfd pfd{fd_, POLLOUT, 0};
+          if (-1 != poll(&pfd, 1, -1) || errno == EINTR) continue;
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          failed_ = true;
+          queued_.clear();
+          queued_bytes_ = 0;
+        }
+        drained_.notify_all();
+        return;
+      }
+
+      offset += result;
+
+      {
+        // Under the lock, so that WaitForQueued cannot miss the signal.
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_bytes_ -= result;
+      }
+      drained_.notify_all();
+
+      if (on_write_) on_write_(queued_bytes_);
+    }
+
+    writing.clear();
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef BASE_ASYNC_WRITER_H_
+#define BASE_ASYNC_WRITER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Writes to a file descriptor from a thread of its own, so that callers never
+// wait for it to become writable.  Data written while an earlier write is in
+// progress goes out together in the next write system call.
+class AsyncWriter {
+ public:
+  // Starts a thread writing to `fd'.  If `on_write' is set, it is called from
+  // that thread after every write, with the number of bytes still queued.
+  explicit AsyncWriter(int fd,
+                       std::function<void(size_t)> on_write = nullptr);
+
+  // Waits for the queued data to be written, unless writing failed.
+  ~AsyncWriter();
+
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+  // Queues `data' to be written.  Never blocks on the file descriptor.
+  void Write(const void* data, size_t size);
+
+  // Waits until at most `size' bytes are queued, or writing failed.  Lets
+  // callers that must not drop data bound the memory used.
+  void WaitForQueued(size_t size);
+
+  // Number of bytes written but not yet accepted by the file descriptor.
+  size_t Queued() const { return queued_bytes_; }
+
+  // Returns true if a write failed, after which data is discarded.
+  bool Failed() const { return failed_; }
+
+ private:
+  void Run();
+
+  const int fd_;
+  const std::function<void(size_t)> on_write_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+
+  // Signaled whenever the queue shrinks.
+  std::condition_variable drained_;
+
+  // Data not yet picked up by the writer thread.  Protected by `mutex_'.
+  std::string queued_;
+  bool stop_;
+
+  // `queued_' plus what is left of the write in progress.
+  std::atomic<size_t> queued_bytes_;
+  std::atomic<bool> failed_;
+
+  std::thread thread_;
+};
+
+#endif  // !BASE_ASYNC_WRITER_H_
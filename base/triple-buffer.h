@@ -0,0 +1,61 @@
+#ifndef BASE_TRIPLE_BUFFER_H_
+#define BASE_TRIPLE_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+
+// Hands values from a writer to a reader without either waiting for the
+// other.  The writer fills in Back() and publishes it, and the reader picks
+// up the most recently published value with Update() and reads it through
+// Front().  Each side owns one of the three buffers, and the third holds the
+// value in transit, so a buffer is never written while it is being read.
+//
+// There must be only one writer and one reader at a time.  A value that is
+// published before the reader got to the previous one replaces it.
+template <typename T>
+class TripleBuffer {
+ public:
+  TripleBuffer() : back_(0), middle_(1), front_(2) {}
+
+  TripleBuffer(const TripleBuffer&) = delete;
+  TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+  // Returns the buffer for the writer to fill in.  It holds whatever was
+  // published two values ago, or a default constructed T.
+  T& Back() { return buffers_[back_]; }
+
+  // Makes Back() the most recently published value, and hands the writer
+  // another buffer.
+  void Publish() {
+    back_ = middle_.exchange(back_ | kFresh, std::memory_order_acq_rel) &
+            kIndexMask;
+  }
+
+  // Returns true if a value has been published that the reader has not
+  // picked up yet.
+  bool Fresh() const {
+    return middle_.load(std::memory_order_acquire) & kFresh;
+  }
+
+  // Moves the most recently published value to Front(), if there is one the
+  // reader has not already picked up.  Returns true if Front() changed.
+  bool Update() {
+    if (!Fresh()) return false;
+    front_ = middle_.exchange(front_, std::memory_order_acq_rel) & kIndexMask;
+    return true;
+  }
+
+  T& Front() { return buffers_[front_]; }
+
+ private:
+  static const uint8_t kIndexMask = 3;
+  static const uint8_t kFresh = 4;
+
+  T buffers_[3];
+
+  uint8_t back_;
+  std::atomic<uint8_t> middle_;
+  uint8_t front_;
+};
+
+#endif  // !BASE_TRIPLE_BUFFER_H_
@@ -0,0 +1,132 @@
+#include "history-file.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+// Size of the pieces the file is grown and mapped in.  Lines never straddle
+// two segments.
+const size_t kSegmentSize = 4 << 20;
+
+// Number of lines between entries in the offset index.  Any other line is
+// found by skipping over the lines in front of it.
+const size_t kIndexInterval = 64;
+
+// Every line is preceded by its size.  A size of zero marks the unused end of
+// a segment.
+typedef uint32_t LineSize;
+
+}  // namespace
+
+HistoryFile::HistoryFile()
+    : fd_(-1),
+      size_(),
+      end_(),
+      write_segment_(),
+      write_segment_index_(),
+      read_segment_(),
+      read_segment_index_() {}
+
+HistoryFile::~HistoryFile() {
+  if (write_segment_) munmap(write_segment_, kSegmentSize);
+  if (read_segment_) munmap(read_segment_, kSegmentSize);
+  if (fd_ != -1) close(fd_);
+}
+
+bool HistoryFile::Open(const char* directory) {
+  std::string path = directory;
+  path += "/cantera-history.XXXXXX";
+
+  if (-1 == (fd_ = mkostemp(&path[0], O_CLOEXEC))) return false;
+
+  // Nothing else needs to find the file, and it should go away with us.
+  unlink(path.c_str());
+
+  return true;
+}
+
+void HistoryFile::Append(const void* data, size_t size) {
+  const LineSize line_size = size;
+  const size_t record_size = sizeof(line_size) + size;
+
+  if (record_size > kSegmentSize) return;
+
+  if (!write_segment_ ||
+      end_ + record_size > (write_segment_index_ + 1) * kSegmentSize) {
+    size_t segment = write_segment_ ? write_segment_index_ + 1 : 0;
+    off_t offset = static_cast<off_t>(segment) * kSegmentSize;
+
+    // Allocating the blocks up front turns a full file system into an error
+    // here, rather than SIGBUS when writing to the mapping.
+    if (posix_fallocate(fd_, offset, kSegmentSize)) return;
+
+    void* map = mmap(nullptr, kSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd_, offset);
+    if (map == MAP_FAILED) return;
+
+    if (write_segment_) munmap(write_segment_, kSegmentSize);
+    write_segment_ = static_cast<unsigned char*>(map);
+    write_segment_index_ = segment;
+    end_ = offset;
+  }
+
+  if (size_ % kIndexInterval == 0) index_.push_back(end_);
+
+  unsigned char* output = write_segment_ + end_ % kSegmentSize;
+  memcpy(output, &line_size, sizeof(line_size));
+  memcpy(output + sizeof(line_size), data, size);
+
+  end_ += record_size;
+  ++size_;
+}
+
+const unsigned char* HistoryFile::Line(size_t index) const {
+  uint64_t offset = index_[index / kIndexInterval];
+
+  for (size_t skip = index % kIndexInterval;;) {
+    const size_t segment = offset / kSegmentSize;
+    const size_t position = offset % kSegmentSize;
+
+    const unsigned char* data = Segment(segment);
+    if (!data) return nullptr;
+
+    LineSize line_size = 0;
+    if (position + sizeof(line_size) <= kSegmentSize)
+      memcpy(&line_size, data + position, sizeof(line_size));
+
+    if (!line_size) {
+      offset = static_cast<uint64_t>(segment + 1) * kSegmentSize;
+      continue;
+    }
+
+    if (!skip--) return data + position + sizeof(line_size);
+
+    offset += sizeof(line_size) + line_size;
+  }
+}
+
+const unsigned char* HistoryFile::Segment(size_t index) const {
+  if (write_segment_ && index == write_segment_index_) return write_segment_;
+
+  if (!read_segment_ || index != read_segment_index_) {
+    if (read_segment_) munmap(read_segment_, kSegmentSize);
+
+    void* map = mmap(nullptr, kSegmentSize, PROT_READ, MAP_SHARED, fd_,
+                     static_cast<off_t>(index) * kSegmentSize);
+    if (map == MAP_FAILED) {
+      read_segment_ = nullptr;
+      return nullptr;
+    }
+
+    read_segment_ = static_cast<unsigned char*>(map);
+    read_segment_index_ = index;
+  }
+
+  return read_segment_;
+}
@@ -0,0 +1,58 @@
+#ifndef HISTORY_FILE_H_
+#define HISTORY_FILE_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Scrollback lines spilled to an unlinked temporary file.  The file grows in
+// fixed size segments, of which only the one being appended to and the one
+// most recently read from are mapped, so the history can grow without bound
+// while taking almost no memory.
+class HistoryFile {
+ public:
+  HistoryFile();
+  ~HistoryFile();
+
+  HistoryFile(const HistoryFile&) = delete;
+  HistoryFile& operator=(const HistoryFile&) = delete;
+
+  // Creates the file in `directory'.  Returns false and sets errno on
+  // failure.
+  bool Open(const char* directory);
+
+  bool IsOpen() const { return fd_ != -1; }
+
+  // Number of lines appended.
+  size_t Size() const { return size_; }
+
+  // Appends a line of `size' bytes, which must not be zero.  The line is
+  // dropped if the file system is full.
+  void Append(const void* data, size_t size);
+
+  // Returns the data of line `index', which stays valid until the next call
+  // to Append or Line, or nullptr if it could not be mapped.
+  const unsigned char* Line(size_t index) const;
+
+ private:
+  // Returns segment `index' mapped into memory, or nullptr on failure.
+  const unsigned char* Segment(size_t index) const;
+
+  int fd_;
+
+  size_t size_;
+
+  // File offset at which the next line is appended.
+  uint64_t end_;
+
+  // File offset of every kIndexInterval'th line.
+  std::vector<uint64_t> index_;
+
+  unsigned char* write_segment_;
+  size_t write_segment_index_;
+
+  mutable unsigned char* read_segment_;
+  mutable size_t read_segment_index_;
+};
+
+#endif  // !HISTORY_FILE_H_
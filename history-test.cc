@@ -0,0 +1,171 @@
+// Checks that lines read back with the same characters and attributes after
+// they have been compressed into the cold history, and spilled to the history
+// file: narrow and wide characters, attribute runs, lines ending in a run of
+// something other than blanks, and blank lines.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "terminal.h"
+
+namespace {
+
+// Long enough for most of it to be compressed, and to wrap around several
+// times.
+const size_t kHistorySize = 3000;
+const size_t kLineCount = 10000;
+
+struct Line {
+  std::vector<Terminal::CharacterType> chars;
+  std::vector<Terminal::Attr> attr;
+};
+
+bool SameColor(const Terminal::Color& lhs, const Terminal::Color& rhs) {
+  return lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b;
+}
+
+bool SameAttr(const Terminal::Attr& lhs, const Terminal::Attr& rhs) {
+  return SameColor(lhs.fg, rhs.fg) && SameColor(lhs.bg, rhs.bg) &&
+         lhs.extra == rhs.extra;
+}
+
+Line GetRow(const Terminal::State& state, size_t row) {
+  Line result;
+  result.chars.assign(&state.chars[row * state.width],
+                      &state.chars[(row + 1) * state.width]);
+  result.attr.assign(&state.attr[row * state.width],
+                     &state.attr[(row + 1) * state.width]);
+  return result;
+}
+
+void CheckRow(const Terminal::State& state, size_t row, const Line& expected) {
+  const Line line = GetRow(state, row);
+
+  assert(line.chars == expected.chars);
+  for (size_t x = 0; x < state.width; ++x)
+    assert(SameAttr(line.attr[x], expected.attr[x]));
+}
+
+// Returns the output that writes one line of at most `width' cells.
+std::string GenerateLine(size_t width) {
+  const size_t length = rand() % (width + 1);
+  std::string result;
+
+  switch (rand() % 6) {
+    case 0:  // Narrow characters with a single attribute.
+      for (size_t i = 0; i < length; ++i)
+        result.push_back(rand() % 8 ? 'a' + rand() % 26 : ' ');
+      break;
+
+    case 1:  // Attribute runs, with some Latin-1 characters.
+      for (size_t i = 0; i < length; ++i) {
+        if (rand() % 8 == 0) {
+          static const char* kExtra[] = {"", "4;", "5;", "24;25;"};
+          result += std::string("\033[") + kExtra[rand() % 4] +
+                    std::to_string(30 + rand() % 8) + ";" +
+                    std::to_string(40 + rand() % 8) + "m";
+        }
+        result += rand() % 4 ? std::string(1, 'a' + rand() % 26) : "\xc3\xa5";
+      }
+      break;
+
+    case 2:  // Characters above 0xff.
+      for (size_t i = 0; i < length; ++i) {
+        switch (rand() % 3) {
+          case 0: result += "\xe4\xb8\xad"; break;
+          case 1: result += "\xce\xb1"; break;
+          case 2: result += 'a' + rand() % 26; break;
+        }
+      }
+      break;
+
+    case 3:  // A trailing run of something other than default blanks.
+      for (size_t i = 0; i < length; ++i) result.push_back('a' + rand() % 26);
+      result += "\033[1;4" + std::to_string(rand() % 8) + "m";
+      if (rand() % 2)
+        result += "\033[K";
+      else
+        result.append(width - length, '-');
+      break;
+
+    case 4:  // Blank.
+      break;
+
+    case 5:  // Blank, with a background color.
+      result += "\033[4" + std::to_string(1 + rand() % 7) + "m\033[2K";
+      break;
+  }
+
+  return result + "\033[0m";
+}
+
+void Test(bool history_file) {
+  Terminal terminal([](const void* data, size_t size) {});
+
+  // Distinct colors, so that a wrong attribute can not go unnoticed.
+  for (unsigned int i = 0; i < 256; ++i)
+    terminal.SetANSIColor(i, Terminal::Color(i, i * 3, i * 7));
+
+  terminal.Init(800, 200, 10, 20, kHistorySize);
+
+  if (history_file) {
+    const char* directory = getenv("TMPDIR");
+    if (!terminal.OpenHistoryFile(directory && *directory ? directory
+                                                          : "/tmp")) {
+      perror("OpenHistoryFile failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const size_t width = terminal.Size().ws_col;
+  const size_t height = terminal.Size().ws_row;
+
+  // Every line as it was written, while it was still on the screen.
+  std::vector<Line> lines;
+
+  for (size_t i = 0; i < kLineCount; ++i) {
+    const std::string data = (i ? "\r\n" : "") + GenerateLine(width);
+    terminal.ProcessData(data.data(), data.size());
+
+    Terminal::State state;
+    terminal.GetState(&state);
+    lines.push_back(GetRow(state, state.cursor_y));
+  }
+
+  // The last line is on the bottom row, and the ones before it above.
+  const size_t history_lines = terminal.HistoryLines();
+  const size_t reachable = std::min(kLineCount, history_lines);
+  if (history_file)
+    assert(reachable == kLineCount);
+  else
+    assert(reachable == height + kHistorySize);
+
+  for (size_t scroll = 0; scroll < reachable; scroll += height) {
+    // A fresh state, so that nothing is left over from the previous rows.
+    Terminal::State state;
+    terminal.history_scroll = scroll;
+    terminal.GetState(&state);
+
+    for (size_t row = 0; row < height; ++row) {
+      // How many lines were written after the one on this row.
+      const size_t age = scroll + height - 1 - row;
+      if (age < reachable) CheckRow(state, row, lines[kLineCount - 1 - age]);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  srand(time(NULL));
+
+  Test(false);
+  Test(true);
+
+  return EXIT_SUCCESS;
+}
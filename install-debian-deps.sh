@@ -1,3 +1,3 @@
 #!/bin/sh
 
-apt install build-essential libfreetype6-dev libmpfr-dev libxrender-dev libxft-dev libglew-dev lintian
+apt install build-essential libfreetype6-dev libmpfr-dev libxrender-dev libxft-dev libglew-dev zlib1g-dev lintian
@@ -3,18 +3,22 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <err.h>
 #include <fcntl.h>
@@ -28,6 +32,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <unistd.h>
@@ -40,14 +45,18 @@
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 
+#include "base/async-writer.h"
 #include "base/string.h"
+#include "base/triple-buffer.h"
 #include "command.h"
 #include "draw.h"
 #include "expr-parse.h"
 #include "font.h"
 #include "glyph.h"
+#include "recording.h"
 #include "terminal.h"
 #include "tree.h"
+#include "uring-pty.h"
 #include "x11.h"
 
 namespace {
@@ -56,6 +65,7 @@ int print_version;
 int print_help;
 
 struct option long_options[] = {{"tty-log", required_argument, 0, 'L'},
+                                {"record", required_argument, 0, 'R'},
                                 {"version", no_argument, &print_version, 1},
                                 {"help", no_argument, &print_help, 1},
                                 {0, 0, 0, 0}};
@@ -76,8 +86,47 @@ int home_fd;
 
 std::unique_ptr<Terminal> terminal;
 
-std::string primary_selection;
-std::string clipboard_text;
+// The primary selection.  Its text is read from the terminal when another
+// client asks for it, rather than copied when it is made.  Empty if the
+// selection was lost, or its text changed.
+Terminal::TextRange primary_range;
+
+// Hash of the text of the primary selection, and the terminal generation it
+// was last compared at, for telling when output changes the text.
+uint64_t primary_hash;
+uint64_t primary_generation;
+
+// Incremented whenever the primary selection changes or is cleared, so that
+// transfers of its old text can tell they must end.
+uint64_t primary_serial;
+
+// Copied when it is made, since it must survive changes to the terminal.
+std::shared_ptr<const std::string> clipboard_text;
+
+// Selections are sent to other clients in pieces of this size, and through
+// the INCR protocol if they need more than one.  It is well below the
+// smallest maximum request size of an X server.
+const size_t kSelectionChunkSize = 64 << 10;
+
+// Reads the next piece of a selection into `chunk'.  Returns false once
+// there is nothing left.
+typedef std::function<bool(std::string* chunk)> SelectionReader;
+
+// A selection being sent to another client with the INCR protocol.  Each
+// time the requestor deletes `property', the next chunk is stored in it, and
+// an empty chunk ends the transfer.
+struct SelectionTransfer {
+  Window requestor;
+  Atom selection;
+  Atom property;
+  Atom target;
+
+  SelectionReader read;
+  std::string chunk;
+  bool more;
+};
+
+std::vector<SelectionTransfer> selection_transfers;
 
 std::string last_expression, expression_result;
 std::string::size_type expression_offset;
@@ -86,17 +135,136 @@ bool clear;
 std::mutex clear_mutex;
 std::condition_variable clear_cond;
 
+// Set when a key is pressed, so that the output it causes is drawn without
+// waiting for the next frame.
+bool key_pressed;
+
+// Minimum time between redraws caused by output.
+std::chrono::steady_clock::duration frame_interval;
+
 pid_t pid;
 int terminal_fd;
 
+// Used for reading and writing terminal_fd if it could be opened, which
+// happens before any of the threads start.
+URingPty terminal_uring;
+
+// Writes to terminal_fd when io_uring is not used.
+std::unique_ptr<AsyncWriter> terminal_writer;
+
+// Writes the capture requested with --tty-log, so that a slow disk does not
+// hold up the processing of output.
+std::unique_ptr<AsyncWriter> log_writer;
+
+// How far the capture may fall behind before TTYReadThread waits for it.
+// Waiting slows the terminal down, but the capture never loses data.
+const size_t kMaxQueuedLog = 16 << 20;
+
+// The session recording requested with --record, with timestamps, input and
+// size changes, for cantera-replay.
+std::unique_ptr<RecordingWriter> recording;
+
+// Set once TTYReadThread has read all output and finished the captures,
+// which the program waits for before it exits.  Protected by reader_mutex.
+std::mutex reader_mutex;
+std::condition_variable reader_cond;
+bool reader_done;
+
+// Incremented by TTYReadThread before and after it waits for output, so
+// that it is odd while the reader is idle.
+std::atomic<uint64_t> reader_waits;
+
+// How long the reader may sit idle, after the shell has exited, before the
+// program stops waiting for more output.  Processes started by the shell
+// can keep the pty open after it is gone.
+const std::chrono::milliseconds kExitTimeout(250);
+
+// How much input may be queued for the pty.  Input beyond this, such as the
+// rest of a large paste, waits in `pending_input' until the queue drains, so
+// that the X event thread never blocks on a full pty.
+const size_t kMaxQueuedInput = 1 << 20;
+
+// Input waiting for room in the write queue, from `pending_input_offset' on.
+// Only used by the X event thread.
+std::string pending_input;
+size_t pending_input_offset;
+
+// Set while there is pending input, for the writer to send xa_input_ready
+// when the queue has drained.
+std::atomic<bool> input_blocked;
+
+// Pasted text is read from the property in pieces of this size, unless the
+// selection owner sends it in chunks of its own choosing.
+const long kPastePieceSize = 64 << 10;
+
+// A paste being read from a selection.  The text is only fetched from the X
+// server when the write queue has room for it, so memory use does not grow
+// with the size of the paste.  Only used by the X event thread.
+struct Paste {
+  // Property holding the text, or None if there is no paste in progress.
+  Atom property = None;
+
+  // Set if the selection owner sends the text in chunks, using the INCR
+  // protocol, and then whether a chunk is waiting to be read.
+  bool incremental = false;
+  bool chunk_ready = false;
+
+  // Where the next piece starts, in 32-bit units, if not incremental.
+  long offset = 0;
+
+  // Number of newlines at the end of the text so far, which are only sent
+  // if more text follows.
+  size_t newlines = 0;
+
+  bool bracketed = false;
+
+  // When the next chunk was asked for, if incremental.
+  std::chrono::steady_clock::time_point chunk_requested;
+};
+
+Paste current_paste;
+
+// Input typed while a paste is in progress, which is sent after the paste so
+// that keys like Enter do not end up inside it.  Only used by the X event
+// thread.
+std::string input_after_paste;
+
+// How long the selection owner may take to send the next chunk of an
+// incremental paste before keys typed in the meantime abandon the paste.
+const std::chrono::seconds kPasteChunkTimeout(5);
+
+// Protects the terminal, including the view and selection state the X event
+// thread changes, such as history_scroll, select_begin and select_end, since
+// TTYReadThread reads them when it publishes a frame.
 std::mutex buffer_mutex;
 
+// How long frames are held back while the application draws with
+// synchronized output, in case it never finishes.
+const std::chrono::milliseconds kSynchronizedOutputTimeout(150);
+
+// When synchronized output was last turned on, and the value of
+// Terminal::synchronized_output_frames at the time.  Protected by
+// buffer_mutex.
+std::chrono::steady_clock::time_point synchronized_output_start;
+uint64_t synchronized_output_frames;
+
 // Last pressed key.
 KeySym prev_key_sym = 0;
 
 std::unordered_map<KeyInfo, void (*)(XKeyEvent* event)> key_callbacks;
 
-Terminal::State draw_state;
+// What the Expose handler draws, copied from the terminal while holding
+// buffer_mutex.
+struct Frame {
+  Terminal::State state;
+
+  // The cursor line up to the cursor, in which to look for expressions.
+  std::string current_line;
+};
+
+// Frames published by TTYReadThread and the Expose handler, so that drawing
+// never holds up the processing of output.
+TripleBuffer<Frame> frames;
 
 }  // namespace
 
@@ -163,20 +331,183 @@ static void CreateLineArtGlyphs(void) {
   free(glyph);
 }
 
+// Returns a hash of the text in `range', which is read in pieces so that a
+// large selection is never copied as a whole.  Must be called with
+// buffer_mutex held.
+static uint64_t HashText(Terminal::TextRange range) {
+  uint64_t hash = 14695981039346656037ULL;
+  std::string chunk;
+
+  while (!range.empty()) {
+    chunk.clear();
+    terminal->ReadText(&range, kSelectionChunkSize, &chunk);
+    for (const auto ch : chunk) {
+      hash ^= static_cast<unsigned char>(ch);
+      hash *= 1099511628211ULL;
+    }
+  }
+
+  return hash;
+}
+
+// Returns the text of the primary selection.  Only for when the whole text
+// is needed at once.
+static std::string GetPrimarySelection() {
+  std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+  return terminal->GetTextInRange(primary_range.begin, primary_range.end);
+}
+
+// Makes transfers of the primary selection in progress end with the next
+// chunk the requestor asks for, since their text is gone.
+static void EndPrimaryTransfers() {
+  ++primary_serial;
+
+  for (auto& transfer : selection_transfers) {
+    if (transfer.selection != XA_PRIMARY) continue;
+    transfer.chunk.clear();
+    transfer.more = false;
+  }
+}
+
+// Forgets the primary selection.  Must be called with buffer_mutex held.
+static void ClearPrimarySelection() {
+  terminal->ClearSelection();
+  primary_range = Terminal::TextRange();
+  EndPrimaryTransfers();
+}
+
+// Ends the primary selection if output has changed its text.  Must be called
+// with buffer_mutex held.
+static void CheckPrimarySelection() {
+  if (primary_range.empty() || primary_generation == terminal->Generation())
+    return;
+
+  primary_generation = terminal->Generation();
+  if (HashText(primary_range) != primary_hash) ClearPrimarySelection();
+}
+
 static void UpdateSelection(Time time) {
-  primary_selection = terminal->GetSelection();
+  {
+    std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+    EndPrimaryTransfers();
+    primary_range = terminal->SelectionRange();
+    primary_hash = HashText(primary_range);
+    primary_generation = terminal->Generation();
+  }
 
   XSetSelectionOwner(X11_display, XA_PRIMARY, X11_window, time);
 
   if (X11_window != XGetSelectionOwner(X11_display, XA_PRIMARY)) {
     /* We did not get the selection */
-    terminal->ClearSelection();
-    primary_selection.clear();
+    std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+    ClearPrimarySelection();
+  }
+}
+
+static SelectionReader PrimarySelectionReader() {
+  Terminal::TextRange range = primary_range;
+  const uint64_t serial = primary_serial;
+
+  return [range, serial](std::string* chunk) mutable {
+    std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+
+    // Output may have scrolled the text since the last chunk, in which case
+    // the range no longer holds it.
+    CheckPrimarySelection();
+    if (primary_serial != serial) return false;
+
+    terminal->ReadText(&range, kSelectionChunkSize, chunk);
+    return !range.empty();
+  };
+}
+
+static SelectionReader StringSelectionReader(
+    std::shared_ptr<const std::string> text) {
+  size_t offset = 0;
+
+  return [text, offset](std::string* chunk) mutable {
+    if (!text) return false;
+    const size_t size = std::min(kSelectionChunkSize, text->size() - offset);
+    chunk->append(*text, offset, size);
+    offset += size;
+    return offset < text->size();
+  };
+}
+
+static void EndSelectionTransfer(
+    std::vector<SelectionTransfer>::iterator transfer) {
+  const Window requestor = transfer->requestor;
+  selection_transfers.erase(transfer);
+
+  if (requestor == X11_window) return;
+
+  for (const auto& other : selection_transfers) {
+    if (other.requestor == requestor) return;
+  }
+
+  XSelectInput(X11_display, requestor, NoEventMask);
+}
+
+// Tells the requestor that the selection comes in chunks, the first of which
+// is `chunk', and sends them as the requestor deletes the property.
+static void StartSelectionTransfer(const XSelectionRequestEvent* request,
+                                   SelectionReader read, std::string chunk) {
+  for (auto i = selection_transfers.begin(); i != selection_transfers.end();
+       ++i) {
+    if (i->requestor == request->requestor &&
+        i->property == request->property) {
+      EndSelectionTransfer(i);
+      break;
+    }
+  }
+
+  // Our own window already selects these events, and must keep the rest.
+  if (request->requestor != X11_window)
+    XSelectInput(X11_display, request->requestor,
+                 PropertyChangeMask | StructureNotifyMask);
+
+  // A lower bound on the size of the selection.
+  const long size = chunk.size();
+  XChangeProperty(X11_display, request->requestor, request->property, xa_incr,
+                  32, PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(&size), 1);
+
+  SelectionTransfer transfer;
+  transfer.requestor = request->requestor;
+  transfer.selection = request->selection;
+  transfer.property = request->property;
+  transfer.target = request->target;
+  transfer.read = std::move(read);
+  transfer.chunk = std::move(chunk);
+  transfer.more = true;
+  selection_transfers.emplace_back(std::move(transfer));
+}
+
+static void ContinueSelectionTransfer(Window requestor, Atom property) {
+  auto transfer = std::find_if(
+      selection_transfers.begin(), selection_transfers.end(),
+      [requestor, property](const SelectionTransfer& transfer) {
+        return transfer.requestor == requestor && transfer.property == property;
+      });
+  if (transfer == selection_transfers.end()) return;
+
+  const std::string& chunk = transfer->chunk;
+  XChangeProperty(X11_display, requestor, property, transfer->target, 8,
+                  PropModeReplace,
+                  reinterpret_cast<const unsigned char*>(chunk.data()),
+                  chunk.size());
+
+  if (chunk.empty()) {
+    EndSelectionTransfer(transfer);
+    return;
   }
+
+  transfer->chunk.clear();
+  if (transfer->more) transfer->more = transfer->read(&transfer->chunk);
 }
 
-static void send_selection(XSelectionRequestEvent* request, const char* text,
-                           size_t length) {
+static void send_selection(XSelectionRequestEvent* request,
+                           SelectionReader read) {
   XSelectionEvent response;
   int ret;
 
@@ -198,13 +529,21 @@ static void send_selection(XSelectionRequestEvent* request, const char* text,
                     sizeof(targets) / sizeof(targets[0]));
   } else if (request->target == XA_STRING ||
              request->target == xa_utf8_string) {
-    ret = XChangeProperty(X11_display, request->requestor, request->property,
-                          request->target, 8, PropModeReplace,
-                          reinterpret_cast<const unsigned char*>(text), length);
+    std::string chunk;
 
-    if (ret != BadAlloc && ret != BadAtom && ret != BadValue &&
-        ret != BadWindow)
+    if (read(&chunk)) {
+      StartSelectionTransfer(request, std::move(read), std::move(chunk));
       response.property = request->property;
+    } else if (!chunk.empty()) {
+      ret = XChangeProperty(
+          X11_display, request->requestor, request->property, request->target,
+          8, PropModeReplace,
+          reinterpret_cast<const unsigned char*>(chunk.data()), chunk.size());
+
+      if (ret != BadAlloc && ret != BadAtom && ret != BadValue &&
+          ret != BadWindow)
+        response.property = request->property;
+    }
   } else {
     fprintf(stderr, "Unknown selection request target: %s\n",
             XGetAtomName(X11_display, request->target));
@@ -242,16 +581,29 @@ void X11_handle_configure(void) {
   }
 
   ioctl(terminal_fd, TIOCSWINSZ, &terminal->Size());
+
+  if (recording)
+    recording->AddResize(terminal->Size().ws_col, terminal->Size().ws_row);
 }
 
 void X11ClearThread() {
+  auto next_frame = std::chrono::steady_clock::now();
+
   for (;;) {
     std::unique_lock<std::mutex> lock(clear_mutex);
     clear_cond.wait(lock, [] { return clear; });
+
+    // Let output arriving before the next frame is due go into the same
+    // redraw, unless it is likely to be the echo of a key press.
+    clear_cond.wait_until(lock, next_frame, [] { return key_pressed; });
     clear = false;
+    key_pressed = false;
+    lock.unlock();
 
     XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
     XFlush(X11_display);
+
+    next_frame = std::chrono::steady_clock::now() + frame_interval;
   }
 }
 
@@ -263,17 +615,143 @@ void X11_Clear(void) {
   clear_cond.notify_one();
 }
 
-static void TTYReadThread(int logfd) {
-  unsigned char buf[4096];
-  ssize_t result;
+// Copies the screen into a new frame for the Expose handler.  Must be called
+// with buffer_mutex held.
+static void PublishFrame() {
+  Frame& frame = frames.Back();
+  terminal->UpdateState(&frame.state);
+  frame.current_line = terminal->GetCurrentLine(true);
+  frames.Publish();
+}
+
+// Returns how much longer frames should be held back because the
+// application is drawing one with synchronized output, or zero.  Must be
+// called with buffer_mutex held.
+static std::chrono::steady_clock::duration FrameHoldTime() {
+  if (!terminal->synchronized_output)
+    return std::chrono::steady_clock::duration::zero();
+
+  const auto elapsed =
+      std::chrono::steady_clock::now() - synchronized_output_start;
+  if (elapsed >= kSynchronizedOutputTimeout)
+    return std::chrono::steady_clock::duration::zero();
+
+  return kSynchronizedOutputTimeout - elapsed;
+}
+
+// Output is parsed in pieces of at most about this size, so that frames can
+// be published while a large amount of output is being processed.
+const size_t kMaxProcessSize = 64 << 10;
+
+// Parses the `count' pieces of output from the pty in `pieces', and publishes
+// a frame unless synchronized output is holding it back.  Returns the poll
+// timeout that makes TTYReadThread show the held back frame when the hold
+// expires, or -1.
+static int ProcessOutput(const iovec* pieces, size_t count) {
+  int timeout = -1;
+
+  {
+    std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+
+    for (size_t i = 0; i < count; ++i)
+      terminal->ProcessData(pieces[i].iov_base, pieces[i].iov_len);
+    if (terminal->synchronized_output_frames != synchronized_output_frames) {
+      synchronized_output_frames = terminal->synchronized_output_frames;
+      synchronized_output_start = std::chrono::steady_clock::now();
+    }
+
+    const auto hold = FrameHoldTime();
+    if (hold > std::chrono::steady_clock::duration::zero()) {
+      using std::chrono::milliseconds;
+      timeout = std::chrono::duration_cast<milliseconds>(hold).count() + 1;
+    } else {
+      // Only copy the screen when the Expose handler has picked up the last
+      // frame, so that the copying does not outpace the drawing.
+      if (!frames.Fresh()) PublishFrame();
+    }
+  }
+
+  if (timeout == -1) X11_Clear();
+
+  return timeout;
+}
+
+// Called by TTYReadThread before it waits for output, and after.
+static void ReaderIdle() { ++reader_waits; }
+static void ReaderBusy() {
+  if (reader_waits & 1) ++reader_waits;
+}
+
+// Queues output from the pty for the --tty-log capture and the --record
+// recording, if any.
+static void LogOutput(const unsigned char* data, size_t size) {
+  if (recording) recording->AddOutput(data, size);
+
+  if (!log_writer) return;
+
+  log_writer->WaitForQueued(kMaxQueuedLog);
+  log_writer->Write(data, size);
+}
+
+// Reads through io_uring until the pty is closed.
+static void TTYReadURing() {
+  // Times out only if a frame is being held back.
+  int timeout = -1;
+
+  // Everything completed since the last wakeup is parsed under one lock and
+  // published as one frame, rather than one pty read at a time.
+  const auto process = [&timeout](const iovec* buffers, size_t count) {
+    ReaderBusy();
+
+    for (size_t i = 0; i < count; ++i) {
+      LogOutput(static_cast<const unsigned char*>(buffers[i].iov_base),
+                buffers[i].iov_len);
+    }
+
+    for (size_t begin = 0; begin < count;) {
+      size_t end = begin, size = 0;
+      while (end < count && size < kMaxProcessSize)
+        size += buffers[end++].iov_len;
+
+      timeout = ProcessOutput(&buffers[begin], end - begin);
+      begin = end;
+    }
+  };
+
+  for (;;) {
+    ReaderIdle();
+    const ssize_t result = terminal_uring.Read(timeout, process);
+    ReaderBusy();
+    if (result == -1) break;
+
+    if (!result) timeout = ProcessOutput(nullptr, 0);
+  }
+}
+
+// Reads with poll and read until the pty is closed.
+static void TTYReadPoll() {
+  // The read buffer doubles in size whenever a read fills it, and halves
+  // when reads leave most of it unused, so that sustained output takes few
+  // system calls while an idle terminal holds on to little memory.
+  static const size_t kMinBufferSize = 4096;
+  static const size_t kMaxBufferSize = 4 << 20;
+
+  size_t buffer_size = kMinBufferSize;
+  std::unique_ptr<unsigned char[]> buf(new unsigned char[buffer_size]);
+  ssize_t result = 0;
   size_t fill = 0;
   struct pollfd pfd;
+  int timeout = -1;
 
   pfd.fd = terminal_fd;
   pfd.events = POLLIN | POLLRDHUP;
 
   for (;;) {
-    if (-1 == poll(&pfd, 1, -1)) {
+    // Times out only if a frame is being held back.
+    ReaderIdle();
+    const int ready = poll(&pfd, 1, timeout);
+    ReaderBusy();
+    if (-1 == ready) {
       if (errno == EINTR) continue;
 
       break;
@@ -281,68 +759,281 @@ static void TTYReadThread(int logfd) {
 
     if (pfd.revents & POLLRDHUP) break;
 
+    if (!ready) {
+      timeout = ProcessOutput(nullptr, 0);
+      continue;
+    }
+
     // Read until EAGAIN/EWOULDBLOCK.
-    while (0 < (result = read(terminal_fd, buf + fill, sizeof(buf) - fill))) {
+    while (0 < (result = read(terminal_fd, &buf[fill], buffer_size - fill))) {
       fill += result;
-      if (fill == sizeof(buf)) break;
+      if (fill == buffer_size) break;
     }
 
     if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK) break;
 
-    if (logfd != -1) {
-      write(logfd, buf, fill);
-    }
+    LogOutput(&buf[0], fill);
 
-    if (!buffer_mutex.try_lock()) {
-      // We couldn't get the lock straight away.  If the buffer is not full,
-      // and we can get more data within 1 ms, go ahead and read that.
-      if (fill < sizeof(buf) && 0 < poll(&pfd, 1, 1)) continue;
+    for (size_t offset = 0; offset < fill;) {
+      const iovec piece{&buf[offset], std::min(fill - offset, kMaxProcessSize)};
+      timeout = ProcessOutput(&piece, 1);
+      offset += piece.iov_len;
+    }
 
-      // No new data available, go ahead and paint.
-      buffer_mutex.lock();
+    // The buffer is empty now, so it can be replaced without copying.
+    if (fill == buffer_size && buffer_size < kMaxBufferSize) {
+      buffer_size *= 2;
+      buf.reset(new unsigned char[buffer_size]);
+    } else if (fill < buffer_size / 4 && buffer_size > kMinBufferSize) {
+      buffer_size /= 2;
+      buf.reset(new unsigned char[buffer_size]);
     }
 
-    terminal->ProcessData(buf, fill);
     fill = 0;
-    buffer_mutex.unlock();
+  }
+}
 
-    X11_Clear();
+// Writes out everything queued for the --tty-log capture, and closes the
+// --record recording.  Called when the pty closes, or before exiting if it
+// stays open, whichever comes first.
+static void FinishCaptures() {
+  static std::once_flag once;
+
+  std::call_once(once, [] {
+    if (log_writer) log_writer->WaitForQueued(0);
+    if (recording) recording->Close();
+  });
+}
+
+// Waits for TTYReadThread to read the rest of the output and finish the
+// captures, or to sit idle for kExitTimeout while the pty stays open.  Output
+// arriving after that is neither shown nor captured.
+static void WaitForReader() {
+  std::unique_lock<std::mutex> lock(reader_mutex);
+  uint64_t waits = reader_waits;
+  auto idle_since = std::chrono::steady_clock::now();
+
+  while (!reader_done) {
+    reader_cond.wait_for(lock, std::chrono::milliseconds(10));
+
+    const auto now = std::chrono::steady_clock::now();
+    const uint64_t current = reader_waits;
+    if (!(current & 1) || current != waits) {
+      waits = current;
+      idle_since = now;
+    } else if (now - idle_since >= kExitTimeout) {
+      break;
+    }
+  }
+}
+
+static void TTYReadThread() {
+  if (terminal_uring.IsOpen())
+    TTYReadURing();
+  else
+    TTYReadPoll();
+
+  FinishCaptures();
+
+  {
+    std::lock_guard<std::mutex> lock(reader_mutex);
+    reader_done = true;
   }
+  reader_cond.notify_all();
 
   done = 1;
 
   X11_Clear();
 }
 
+// Queues data for the pty.  Called from TTYReadThread for replies to the
+// application, and through SendInput for everything else.
 static void WriteToTTY(const void* data, size_t len) {
-  size_t off = 0;
-  ssize_t result;
-
-  while (off < len) {
-    result = write(terminal_fd, reinterpret_cast<const char*>(data) + off,
-                   len - off);
-
-    if (result < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        struct pollfd pfd{terminal_fd, POLLOUT, 0};
-        if (poll(&pfd, 1, -1) < 0) {
-          done = 1;
-          break;
-        }
-        continue;
-      }
+  if (recording) recording->AddInput(data, len);
 
-      done = 1;
+  if (terminal_uring.IsOpen())
+    terminal_uring.Write(data, len);
+  else
+    terminal_writer->Write(data, len);
+}
 
-      break;
+// Returns the number of bytes queued for the pty.
+static size_t QueuedForTTY() {
+  return terminal_uring.IsOpen() ? terminal_uring.Queued()
+                                 : terminal_writer->Queued();
+}
+
+// Called from the writer after every write to the pty.
+static void TTYWritten(size_t queued) {
+  if (queued > kMaxQueuedInput / 2 || !input_blocked.exchange(false)) return;
+
+  XClientMessageEvent event;
+  memset(&event, 0, sizeof(event));
+  event.type = ClientMessage;
+  event.window = X11_window;
+  event.message_type = xa_input_ready;
+  event.format = 32;
+  XSendEvent(X11_display, X11_window, False, NoEventMask,
+             reinterpret_cast<XEvent*>(&event));
+  XFlush(X11_display);
+}
+
+// Moves as much pending input to the write queue as there is room for.
+static void FlushInput() {
+  for (;;) {
+    const size_t queued = QueuedForTTY();
+    if (queued < kMaxQueuedInput) {
+      const size_t amount =
+          std::min(kMaxQueuedInput - queued,
+                   pending_input.size() - pending_input_offset);
+      WriteToTTY(&pending_input[pending_input_offset], amount);
+      pending_input_offset += amount;
+    }
+
+    if (pending_input_offset == pending_input.size()) {
+      pending_input.clear();
+      pending_input_offset = 0;
+      return;
+    }
+
+    // The queue may have drained before the flag was set, in which case
+    // nobody else is going to notice.
+    input_blocked = true;
+    if (QueuedForTTY() > kMaxQueuedInput / 2 || !input_blocked.exchange(false))
+      return;
+  }
+}
+
+// Queues input from the X event thread for the pty, in order.
+static void QueueInput(const void* data, size_t len) {
+  if (pending_input.empty() && QueuedForTTY() + len <= kMaxQueuedInput) {
+    WriteToTTY(data, len);
+    return;
+  }
+
+  pending_input.append(static_cast<const char*>(data), len);
+  FlushInput();
+}
+
+static void QueueInputString(const char* string) {
+  QueueInput(string, strlen(string));
+}
+
+static void FinishPaste();
+
+// Sends input other than pasted text to the pty.  While a paste is in
+// progress, the input is held back until the paste is finished, even when
+// the paste is waiting for the selection owner rather than the pty.
+static void SendInput(const void* data, size_t len) {
+  if (current_paste.property != None) {
+    const bool stalled =
+        current_paste.incremental && !current_paste.chunk_ready &&
+        pending_input.empty() &&
+        std::chrono::steady_clock::now() - current_paste.chunk_requested >
+            kPasteChunkTimeout;
+
+    if (!stalled) {
+      input_after_paste.append(static_cast<const char*>(data), len);
+      return;
     }
 
-    off += result;
+    FinishPaste();
+  }
+
+  QueueInput(data, len);
+}
+
+// Sends text from the selection, holding back trailing newlines.
+static void SendPasteText(const unsigned char* text, size_t length) {
+  size_t end = length;
+  while (end > 0 && text[end - 1] == '\n') --end;
+
+  if (!end) {
+    current_paste.newlines += length;
+    return;
+  }
+
+  if (current_paste.newlines) {
+    const std::string newlines(current_paste.newlines, '\n');
+    QueueInput(newlines.data(), newlines.size());
+  }
+
+  QueueInput(text, end);
+  current_paste.newlines = length - end;
+}
+
+// Ends the paste in progress, and sends the input held back during it.
+static void FinishPaste() {
+  XDeleteProperty(X11_display, X11_window, current_paste.property);
+
+  if (current_paste.bracketed) QueueInputString("\033[201~");
+
+  current_paste = Paste();
+
+  if (!input_after_paste.empty()) {
+    QueueInput(input_after_paste.data(), input_after_paste.size());
+    input_after_paste.clear();
+  }
+}
+
+// Reads as much of the paste in progress as the write queue has room for.
+static void ContinuePaste() {
+  while (current_paste.property != None && pending_input.empty()) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char* prop;
+
+    if (current_paste.incremental) {
+      if (!current_paste.chunk_ready) return;
+      current_paste.chunk_ready = false;
+
+      // Deleting the property tells the owner to send the next chunk.
+      current_paste.chunk_requested = std::chrono::steady_clock::now();
+      if (Success != XGetWindowProperty(X11_display, X11_window,
+                                        current_paste.property, 0, INT_MAX / 4,
+                                        True, AnyPropertyType, &type, &format,
+                                        &nitems, &bytes_after, &prop)) {
+        FinishPaste();
+        return;
+      }
+
+      if (type == xa_utf8_string && format == 8)
+        SendPasteText(prop, nitems);
+      XFree(prop);
+
+      // The last chunk is empty.
+      if (!nitems) FinishPaste();
+    } else {
+      if (Success != XGetWindowProperty(X11_display, X11_window,
+                                        current_paste.property,
+                                        current_paste.offset,
+                                        kPastePieceSize / 4, False,
+                                        AnyPropertyType, &type, &format,
+                                        &nitems, &bytes_after, &prop)) {
+        FinishPaste();
+        return;
+      }
+
+      current_paste.offset += nitems / 4;
+      SendPasteText(prop, nitems);
+      XFree(prop);
+
+      if (!bytes_after) FinishPaste();
+    }
   }
 }
 
-static void WriteStringToTTY(const char* string) {
-  WriteToTTY(string, strlen(string));
+// Sends the input for a key, prefixed by ESC if Alt is held, in one write.
+static void SendKeyInput(unsigned int state, const char* text, size_t len) {
+  if (!(state & Mod1Mask)) {
+    SendInput(text, len);
+    return;
+  }
+
+  std::string input("\033");
+  input.append(text, len);
+  SendInput(input.data(), input.size());
 }
 
 static bool WaitForDeadChildren() {
@@ -357,6 +1048,31 @@ static bool WaitForDeadChildren() {
   return false;
 }
 
+// Returns the largest useful value of Terminal::history_scroll, which is
+// limited by its type when the history file holds more lines than that.
+// Must be called with buffer_mutex held.
+unsigned int MaxHistoryScroll() {
+  return std::min<size_t>(terminal->HistoryLines() - terminal->Size().ws_row,
+                          UINT_MAX);
+}
+
+// Scrolls the view `lines' further back into the history, or towards the
+// screen if negative, as far as it goes, and redraws if it moved.
+static void ScrollHistory(long lines) {
+  {
+    std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+    const size_t current = terminal->history_scroll;
+    const size_t scroll =
+        lines < 0
+            ? current - std::min(current, 0 - static_cast<size_t>(lines))
+            : std::min<size_t>(current + lines, MaxHistoryScroll());
+    if (scroll == current) return;
+    terminal->history_scroll = scroll;
+  }
+
+  XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
+}
+
 void HandleKeyPress(KeySym key_sym, const char* text, size_t len,
                     unsigned int modifier_mask, XEvent* event,
                     bool& history_scroll_reset) {
@@ -377,43 +1093,23 @@ void HandleKeyPress(KeySym key_sym, const char* text, size_t len,
   if ((modifier_mask & ShiftMask) && key_sym == XK_Up) {
     history_scroll_reset = false;
 
-    if (terminal->history_scroll < scroll_extra) {
-      ++terminal->history_scroll;
-      XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
-    }
+    ScrollHistory(1);
   } else if ((modifier_mask & ShiftMask) && key_sym == XK_Down) {
     history_scroll_reset = false;
 
-    if (terminal->history_scroll) {
-      --terminal->history_scroll;
-      XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
-    }
+    ScrollHistory(-1);
   } else if ((modifier_mask & ShiftMask) && key_sym == XK_Page_Up) {
     history_scroll_reset = false;
 
-    terminal->history_scroll += terminal->Size().ws_row;
-
-    if (terminal->history_scroll > scroll_extra)
-      terminal->history_scroll = scroll_extra;
-
-    XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
+    ScrollHistory(terminal->Size().ws_row);
   } else if ((modifier_mask & ShiftMask) && key_sym == XK_Page_Down) {
     history_scroll_reset = false;
 
-    if (terminal->history_scroll > terminal->Size().ws_row)
-      terminal->history_scroll -= terminal->Size().ws_row;
-    else
-      terminal->history_scroll = 0;
-
-    XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
+    ScrollHistory(-static_cast<long>(terminal->Size().ws_row));
   } else if ((modifier_mask & ShiftMask) && key_sym == XK_Home) {
     history_scroll_reset = false;
 
-    if (terminal->history_scroll != scroll_extra) {
-      terminal->history_scroll = scroll_extra;
-
-      XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
-    }
+    ScrollHistory(LONG_MAX);
   } else {
     auto handler = key_callbacks.find(
         KeyInfo(key_sym, modifier_mask & (ControlMask | ShiftMask)));
@@ -421,12 +1117,10 @@ void HandleKeyPress(KeySym key_sym, const char* text, size_t len,
     if (handler != key_callbacks.end()) {
       handler->second(&event->xkey);
     } else if (len) {
-      if ((modifier_mask & Mod1Mask)) WriteStringToTTY("\033");
-
       if (len == 1 && (text[0] == ('S' & 0x3f) || text[0] == ('Q' && 0x3f)))
         history_scroll_reset = false;
 
-      WriteToTTY(text, len);
+      SendKeyInput(modifier_mask, text, len);
     }
   }
 }
@@ -434,8 +1128,8 @@ void HandleKeyPress(KeySym key_sym, const char* text, size_t len,
 void SetupKeyCallbacks() {
 #define MAP_KEY_TO_STRING(keysym, string)                  \
   key_callbacks[keysym] = [](XKeyEvent* event) {           \
-    if (event->state & Mod1Mask) WriteStringToTTY("\033"); \
-    WriteStringToTTY((string));                            \
+    const char* text = (string);                           \
+    SendKeyInput(event->state, text, strlen(text));        \
   };
 
   MAP_KEY_TO_STRING(XK_F1, "\033OP");
@@ -472,14 +1166,17 @@ void SetupKeyCallbacks() {
       std::string text(last_expression.size() - expression_offset, '\b');
       text.insert(text.end(), expression_result.begin(),
                   expression_result.end());
-      WriteToTTY(text.data(), text.length());
+      SendInput(text.data(), text.length());
     }
   };
 
   /* Clipboard handling */
   key_callbacks[KeyInfo(XK_C, ControlMask | ShiftMask)] = [](XKeyEvent* event) {
-    if (!primary_selection.empty()) {
-      clipboard_text = primary_selection;
+    if (primary_range.empty()) return;
+
+    std::string text = GetPrimarySelection();
+    if (!text.empty()) {
+      clipboard_text = std::make_shared<const std::string>(std::move(text));
 
       XSetSelectionOwner(X11_display, xa_clipboard, X11_window, event->time);
     }
@@ -515,6 +1212,12 @@ int x11_process_events() {
          */
         if (event.xkey.send_event) break;
 
+        {
+          std::lock_guard<std::mutex> lock(clear_mutex);
+          key_pressed = true;
+          clear_cond.notify_one();
+        }
+
         {
           char text[32];
           Status status;
@@ -531,10 +1234,7 @@ int x11_process_events() {
           HandleKeyPress(key_sym, text, len, modifier_mask, &event,
                          history_scroll_reset);
 
-          if (history_scroll_reset && terminal->history_scroll) {
-            terminal->history_scroll = 0;
-            XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
-          }
+          if (history_scroll_reset) ScrollHistory(LONG_MIN);
 
           prev_key_sym = key_sym;
         }
@@ -544,10 +1244,11 @@ int x11_process_events() {
       case MotionNotify:
 
         if (event.xbutton.state & Button1Mask) {
-          int x, y;
-          unsigned int size;
+          std::unique_lock<std::mutex> buffer_lock(buffer_mutex);
 
-          size = terminal->history_size * terminal->Size().ws_col;
+          int x, y;
+          const size_t size =
+              terminal->HistoryLines() * terminal->Size().ws_col;
 
           x = std::max(0,
                        std::min(terminal->Size().ws_col - 1,
@@ -561,8 +1262,8 @@ int x11_process_events() {
           size_t new_select_end = y * terminal->Size().ws_col + x;
 
           if (terminal->history_scroll)
-            new_select_end +=
-                size - (terminal->history_scroll * terminal->Size().ws_col);
+            new_select_end += size - size_t{terminal->history_scroll} *
+                                         terminal->Size().ws_col;
 
           if (event.xbutton.state & ControlMask)
             terminal->FindRange(Terminal::kRangeWordOrURL,
@@ -570,6 +1271,7 @@ int x11_process_events() {
 
           if (new_select_end != terminal->select_end) {
             terminal->select_end = new_select_end;
+            buffer_lock.unlock();
 
             XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
           }
@@ -585,9 +1287,12 @@ int x11_process_events() {
         switch (event.xbutton.button) {
           case 1: {
             // Left button.
-            primary_selection.clear();
+            std::unique_lock<std::mutex> buffer_lock(buffer_mutex);
 
-            size_t size = terminal->history_size * terminal->Size().ws_col;
+            primary_range = Terminal::TextRange();
+            EndPrimaryTransfers();
+
+            size_t size = terminal->HistoryLines() * terminal->Size().ws_col;
 
             int x =
                 std::min(static_cast<unsigned int>(terminal->Size().ws_col) - 1,
@@ -600,7 +1305,8 @@ int x11_process_events() {
 
             if (terminal->history_scroll) {
               terminal->select_begin +=
-                  size - (terminal->history_scroll * terminal->Size().ws_col);
+                  size -
+                  size_t{terminal->history_scroll} * terminal->Size().ws_col;
             }
 
             terminal->select_end = terminal->select_begin;
@@ -613,6 +1319,8 @@ int x11_process_events() {
                                  &terminal->select_begin, &terminal->select_end);
             }
 
+            buffer_lock.unlock();
+
             XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
           } break;
 
@@ -624,19 +1332,13 @@ int x11_process_events() {
 
           case 4: /* Up */
 
-            if (terminal->history_scroll < scroll_extra) {
-              ++terminal->history_scroll;
-              XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
-            }
+            ScrollHistory(1);
 
             break;
 
           case 5: /* Down */
 
-            if (terminal->history_scroll) {
-              --terminal->history_scroll;
-              XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
-            }
+            ScrollHistory(-1);
 
             break;
         }
@@ -649,8 +1351,10 @@ int x11_process_events() {
         if (event.xbutton.button == 1) {
           UpdateSelection(event.xbutton.time);
 
-          if (!primary_selection.empty() && (event.xkey.state & Mod1Mask))
-            Command(home_fd, "open-url").AddArg(primary_selection).Run();
+          if (!primary_range.empty() && (event.xkey.state & Mod1Mask)) {
+            const std::string url = GetPrimarySelection();
+            if (!url.empty()) Command(home_fd, "open-url").AddArg(url).Run();
+          }
         }
 
         break;
@@ -660,32 +1364,29 @@ int x11_process_events() {
 
         if (request->property == None) request->property = request->target;
 
-        if (request->selection == XA_PRIMARY) {
-          if (!primary_selection.empty())
-            send_selection(request, primary_selection.data(),
-                           primary_selection.size());
-        } else if (request->selection == xa_clipboard) {
-          if (!clipboard_text.empty())
-            send_selection(request, clipboard_text.data(),
-                           clipboard_text.size());
-        }
+        if (request->selection == XA_PRIMARY)
+          send_selection(request, PrimarySelectionReader());
+        else if (request->selection == xa_clipboard)
+          send_selection(request, StringSelectionReader(clipboard_text));
       } break;
 
       case SelectionNotify: {
-        Atom selection;
+        Atom property;
         Atom type;
         int format;
         unsigned long nitems;
         unsigned long bytes_after;
         unsigned char* prop;
 
-        if (terminal->bracketed_paste) {
-          WriteStringToTTY("\033[200~");
-        }
+        /* The selection could not be converted.  */
+        if (event.xselection.property == None) break;
 
-        selection = event.xselection.selection;
+        /* A new paste ends any paste the owner stopped sending.  */
+        if (current_paste.property != None) FinishPaste();
 
-        result = XGetWindowProperty(X11_display, X11_window, selection, 0, 0,
+        property = event.xselection.property;
+
+        result = XGetWindowProperty(X11_display, X11_window, property, 0, 0,
                                     False, AnyPropertyType, &type, &format,
                                     &nitems, &bytes_after, &prop);
 
@@ -693,30 +1394,70 @@ int x11_process_events() {
 
         XFree(prop);
 
-        result = XGetWindowProperty(X11_display, X11_window, selection, 0,
-                                    bytes_after, False, AnyPropertyType, &type,
-                                    &format, &nitems, &bytes_after, &prop);
+        if (type == xa_incr) {
+          current_paste.incremental = true;
+        } else if (type != xa_utf8_string || format != 8) {
+          XDeleteProperty(X11_display, X11_window, property);
+          break;
+        }
 
-        if (result != Success) break;
+        current_paste.property = property;
+        current_paste.bracketed = terminal->bracketed_paste;
 
-        if (type != xa_utf8_string || format != 8) break;
+        if (current_paste.bracketed) QueueInputString("\033[200~");
 
-        /* Remove trailing newlines.  */
-        while (nitems > 0 && prop[nitems - 1] == '\n') --nitems;
+        /* Deleting the INCR property tells the owner to send the first
+         * chunk.  */
+        if (current_paste.incremental) {
+          current_paste.chunk_requested = std::chrono::steady_clock::now();
+          XDeleteProperty(X11_display, X11_window, property);
+        }
+
+        ContinuePaste();
+      } break;
 
-        WriteToTTY(prop, nitems);
+      case PropertyNotify:
 
-        XFree(prop);
+        if (event.xproperty.state == PropertyDelete)
+          ContinueSelectionTransfer(event.xproperty.window,
+                                    event.xproperty.atom);
 
-        if (terminal->bracketed_paste) {
-          WriteStringToTTY("\033[201~");
+        if (current_paste.incremental &&
+            event.xproperty.atom == current_paste.property &&
+            event.xproperty.state == PropertyNewValue) {
+          current_paste.chunk_ready = true;
+          ContinuePaste();
         }
-      } break;
+
+        break;
+
+      case DestroyNotify:
+
+        for (auto i = selection_transfers.begin();
+             i != selection_transfers.end();) {
+          if (i->requestor == event.xdestroywindow.window)
+            i = selection_transfers.erase(i);
+          else
+            ++i;
+        }
+
+        break;
+
+      case ClientMessage:
+
+        if (event.xclient.message_type == xa_input_ready) {
+          FlushInput();
+          ContinuePaste();
+        }
+
+        break;
 
       case SelectionClear:
 
-        if (event.xselectionclear.selection == XA_PRIMARY)
-          terminal->ClearSelection();
+        if (event.xselectionclear.selection == XA_PRIMARY) {
+          std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+          ClearPrimarySelection();
+        }
 
         break;
 
@@ -751,19 +1492,24 @@ int x11_process_events() {
         while (XCheckTypedWindowEvent(X11_display, X11_window, Expose, &event))
           ; /* Do nothing */
 
-        std::string new_expression;
-
-        {
-          std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
-          if (!primary_selection.empty() &&
-              primary_selection != terminal->GetSelection())
-            terminal->ClearSelection();
-
-          terminal->GetState(&draw_state);
-
-          new_expression = terminal->GetCurrentLine(true);
+        // Bring the frame up to date with changes made from this thread, such
+        // as scrolling.  If TTYReadThread is busy, it publishes a frame and
+        // triggers another Expose when it is done, so there is no need to
+        // wait for it.
+        if (buffer_mutex.try_lock()) {
+          // Output that changes the text of the primary selection ends it.
+          CheckPrimarySelection();
+
+          if (FrameHoldTime() == std::chrono::steady_clock::duration::zero())
+            PublishFrame();
+          buffer_mutex.unlock();
         }
 
+        frames.Update();
+        Frame& frame = frames.Front();
+        Terminal::State& draw_state = frame.state;
+        const std::string& new_expression = frame.current_line;
+
         if (new_expression != last_expression) {
           // TODO(mortehu): Move processing to a separate thread.
           expression_result.clear();
@@ -795,7 +1541,10 @@ int x11_process_events() {
 
       case FocusIn:
 
-        terminal->focused = true;
+        {
+          std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+          terminal->focused = true;
+        }
         XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
 
         break;
@@ -812,7 +1561,10 @@ int x11_process_events() {
 
       case FocusOut:
 
-        terminal->focused = false;
+        {
+          std::lock_guard<std::mutex> buffer_lock(buffer_mutex);
+          terminal->focused = false;
+        }
         XClearArea(X11_display, X11_window, 0, 0, 0, 0, True);
 
         prev_key_sym = 0;
@@ -857,10 +1609,11 @@ int main(int argc, char** argv) {
   const char* home;
   char *palette_str, *token;
   int logfd = -1;
+  const char* record_path = nullptr;
 
   setlocale(LC_ALL, "en_US.UTF-8");
 
-  while ((i = getopt_long(argc, argv, "L:", long_options, 0)) != -1) {
+  while ((i = getopt_long(argc, argv, "L:R:", long_options, 0)) != -1) {
     switch (i) {
       case 0:
         break;
@@ -872,6 +1625,12 @@ int main(int argc, char** argv) {
 
         break;
 
+      case 'R':
+
+        record_path = optarg;
+
+        break;
+
       case '?':
 
         fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
@@ -886,6 +1645,9 @@ int main(int argc, char** argv) {
         "\n"
         "  -L, --tty-log=FILE  log all data sent to and received from the tty to "
         "                      FILE\n"
+        "  -R, --record=FILE   record the session with timestamps, input and "
+        "size\n"
+        "                      changes to FILE, for cantera-replay\n"
         "      --help     display this help and exit\n"
         "      --version  display version information\n"
         "\n"
@@ -930,6 +1692,11 @@ int main(int argc, char** argv) {
   font_weight =
       tree_get_integer_default(config.get(), "terminal.font-weight", 200);
 
+  const long long frame_rate = std::max(
+      1LL, tree_get_integer_default(config.get(), "terminal.frame-rate", 60));
+  frame_interval =
+      std::chrono::steady_clock::duration(std::chrono::seconds(1)) / frame_rate;
+
   X11_window_width = tree_get_integer_default(config.get(), "terminal.width", 800);
   X11_window_height = tree_get_integer_default(config.get(), "terminal.height", 600);
 
@@ -963,18 +1730,51 @@ int main(int argc, char** argv) {
   terminal->Init(X11_window_width, X11_window_height, FONT_SpaceWidth(font),
                  FONT_LineHeight(font), scroll_extra);
 
+  if (tree_get_integer_default(config.get(), "terminal.history-file", 0)) {
+    const char* directory = getenv("TMPDIR");
+    if (!directory || !*directory) directory = "/tmp";
+
+    if (!terminal->OpenHistoryFile(directory))
+      warn("Failed to create history file in `%s'", directory);
+  }
+
   StartSubprocess(argc, argv);
 
   fcntl(terminal_fd, F_SETFL, O_NDELAY);
 
+  // Off by default, since pty-bench shows io_uring saving system calls but
+  // not reading any faster than poll.  Falls back to poll and read if
+  // io_uring is not available.
+  terminal_uring.SetWriteCallback(TTYWritten);
+  if (tree_get_integer_default(config.get(), "terminal.io-uring", 0))
+    terminal_uring.Open(terminal_fd);
+
+  if (!terminal_uring.IsOpen())
+    terminal_writer.reset(new AsyncWriter(terminal_fd, TTYWritten));
+
+  // Opened before the window is configured, so that the recording starts
+  // with the terminal size.
+  if (record_path) {
+    recording.reset(new RecordingWriter);
+    if (!recording->Open(record_path))
+      err(EXIT_FAILURE, "Failed to create recording `%s'", record_path);
+  }
+
   X11_handle_configure();
 
   init_gl_30();
 
-  std::thread(TTYReadThread, logfd).detach();
+  if (logfd != -1) log_writer.reset(new AsyncWriter(logfd));
+
+  std::thread(TTYReadThread).detach();
   std::thread(X11ClearThread).detach();
 
   if (-1 == x11_process_events()) return EXIT_FAILURE;
 
+  // The shell is gone, but TTYReadThread may still be reading its last
+  // output, or waiting for the captures to be written.
+  WaitForReader();
+  FinishCaptures();
+
   _Exit(EXIT_SUCCESS);
 }
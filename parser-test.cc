@@ -0,0 +1,231 @@
+// Checks how the escape sequence parser handles malformed input, by comparing
+// the screen after each input with the screen after an equivalent well-formed
+// one, and that splitting the input at any byte gives the same screen.  Also
+// checks that line feeds batched into one scroll of a scroll region give the
+// same screen and history as line feeds written one at a time.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include "terminal.h"
+
+namespace {
+
+struct Case {
+  const char* name;
+  std::string input;
+  std::string expected;
+};
+
+const std::string kSixteenZeros = "0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;";
+
+const Case kCases[] = {
+    // C0 controls inside a sequence are executed without ending it.
+    {"line feed in CSI", "ab\033[2\n;5Hc", "ab\n\033[2;5Hc"},
+    {"backspace in CSI", "ab\033[3\b1mc", "ab\b\033[31mc"},
+    {"carriage return after ESC", "ab\033\rDc", "ab\r\033Dc"},
+    {"tab in CSI intermediate", "ab\033[ \tqc", "ab\tc"},
+
+    // ESC abandons the sequence in progress and starts a new one.
+    {"ESC in CSI", "\033[31\033[32ma", "\033[32ma"},
+    {"ESC in OSC", "\033]0;title\033[32ma", "\033[32ma"},
+    {"ESC after ESC", "\033(\0330a", "a"},
+
+    // CAN and SUB cancel the sequence.
+    {"CAN in CSI", "\033[4\0302ma", "2ma"},
+    {"SUB in CSI", "\033[4\0322ma", "2ma"},
+    {"CAN in OSC", "\033]0;ti\030tle", "tle"},
+    {"SUB in DCS", "\033Pq\032a", "a"},
+
+    // DCS, SOS, PM and APC strings are skipped up to ST, control characters
+    // included.
+    {"DCS", "a\033Pq#0;1\r\n\033\\b", "ab"},
+    {"SOS", "a\033Xtext\n\033\\b", "ab"},
+    {"PM", "a\033^text\b\033\\b", "ab"},
+    {"APC", "a\033_text\t\033\\b", "ab"},
+
+    // Parameters after the 16th overwrite the last one.
+    {"17 parameters", "\033[" + kSixteenZeros + "4;32ma", "\033[32ma"},
+    {"30 parameters", "\033[" + kSixteenZeros + kSixteenZeros + "1;33ma",
+     "\033[33ma"},
+    {"large parameter", "\033[99999999999999999999Ca", "\033[999Ca"},
+
+    // An indexed color without its index is ignored.
+    {"38;5 without index", "\033[31m\033[38;5ma", "\033[31ma"},
+    {"48;5 without index", "\033[42m\033[48;5ma", "\033[42ma"},
+
+    // ESC and control characters end a partial UTF-8 sequence, so that the
+    // continuation bytes after them are dropped.
+    {"ESC in two byte UTF-8", "\xc3\033[4m\xa5" "a", "\033[4ma"},
+    {"ESC in three byte UTF-8", "\xe4\xb8\033[5m\xad" "a", "\033[5ma"},
+    {"line feed in UTF-8", "\xc3\n\xa5" "a", "\na"},
+    {"CAN in UTF-8", "\xe4\030\xb8\xad" "a", "a"},
+};
+
+// Scroll regions as top and bottom rows, counted from 1 like in DECSTBM, of
+// a 24 row screen.
+const struct {
+  int top, bottom;
+} kScrollRegions[] = {{2, 20}, {1, 20}, {5, 24}, {12, 13}};
+
+// Lines written at the bottom of each scroll region.
+const size_t kLineCount = 500;
+
+bool SameColor(const Terminal::Color& lhs, const Terminal::Color& rhs) {
+  return lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b;
+}
+
+bool SameAttr(const Terminal::Attr& lhs, const Terminal::Attr& rhs) {
+  return SameColor(lhs.fg, rhs.fg) && SameColor(lhs.bg, rhs.bg) &&
+         lhs.extra == rhs.extra;
+}
+
+bool SameScreen(const Terminal::State& lhs, const Terminal::State& rhs) {
+  if (lhs.width != rhs.width || lhs.height != rhs.height ||
+      lhs.cursor_x != rhs.cursor_x || lhs.cursor_y != rhs.cursor_y ||
+      lhs.chars != rhs.chars)
+    return false;
+
+  for (size_t i = 0; i < lhs.attr.size(); ++i)
+    if (!SameAttr(lhs.attr[i], rhs.attr[i])) return false;
+
+  return true;
+}
+
+void InitTerminal(Terminal* terminal, unsigned int height) {
+  // Distinct colors, so that a wrong attribute can not go unnoticed.
+  for (unsigned int i = 0; i < 256; ++i)
+    terminal->SetANSIColor(i, Terminal::Color(i, i * 3, i * 7));
+
+  terminal->Init(800, height, 10, 20, 100);
+}
+
+// Returns the screen after writing `pieces' with one ProcessData call each.
+Terminal::State Run(const std::vector<std::string>& pieces) {
+  Terminal terminal([](const void* data, size_t size) {});
+  InitTerminal(&terminal, 200);
+
+  for (const auto& piece : pieces)
+    terminal.ProcessData(piece.data(), piece.size());
+
+  Terminal::State state;
+  terminal.GetState(&state);
+  return state;
+}
+
+void Check(const char* name, const Terminal::State& state,
+           const Terminal::State& expected, const char* how) {
+  if (SameScreen(state, expected)) return;
+
+  fprintf(stderr, "%s: unexpected screen %s\n", name, how);
+  exit(EXIT_FAILURE);
+}
+
+void TestCase(const Case& test) {
+  const Terminal::State expected = Run({test.expected});
+  Check(test.name, Run({test.input}), expected, "when written whole");
+
+  // The same, with the input split at every byte boundary.
+  for (size_t i = 1; i < test.input.size(); ++i) {
+    const std::string where = "when split after byte " + std::to_string(i);
+    Check(test.name,
+          Run({test.input.substr(0, i), test.input.substr(i)}), expected,
+          where.c_str());
+  }
+
+  std::vector<std::string> bytes;
+  for (char ch : test.input) bytes.emplace_back(1, ch);
+  Check(test.name, Run(bytes), expected, "when written one byte at a time");
+}
+
+// Returns the output that writes one line of a `width' column screen, which
+// may wrap, and ends it with a line feed.  Most lines are plain text, so that
+// runs of them can be batched.
+std::string GenerateLine(size_t width) {
+  const size_t length =
+      rand() % 2 ? rand() % (width / 2) : rand() % (width * 5 / 2 + 1);
+  const bool escapes = rand() % 4 == 0;
+  std::string result;
+
+  for (size_t i = 0; i < length; ++i) {
+    switch (rand() % (escapes ? 16 : 8)) {
+      case 0: result += "\xc3\xa5"; break;
+      case 1: result += "\xe4\xb8\xad"; break;
+      case 8: result += "\033[" + std::to_string(30 + rand() % 8) + "m"; break;
+      case 9: result += "\033[K"; break;
+      case 10: result += '\t'; break;
+      default: result += 'a' + rand() % 26; break;
+    }
+  }
+
+  switch (rand() % 4) {
+    case 0: return result + "\n";
+    case 1: return result + "\r\n\r\n";
+    default: return result + "\r\n";
+  }
+}
+
+// Returns every line the terminal can reach, as seen through GetState at each
+// possible history_scroll.
+std::vector<Terminal::State> ReadHistory(Terminal* terminal) {
+  std::vector<Terminal::State> result;
+
+  for (size_t scroll = 0; scroll < terminal->HistoryLines();
+       scroll += terminal->Size().ws_row) {
+    terminal->history_scroll = scroll;
+    result.emplace_back();
+    terminal->GetState(&result.back());
+  }
+  terminal->history_scroll = 0;
+
+  return result;
+}
+
+void TestScrollRegion(int top, int bottom) {
+  Terminal whole([](const void* data, size_t size) {});
+  Terminal bytes([](const void* data, size_t size) {});
+  InitTerminal(&whole, 480);
+  InitTerminal(&bytes, 480);
+
+  // Fill the screen, so that the region has something to scroll away, and put
+  // the cursor on the bottom row of the region.
+  std::string data;
+  for (size_t i = 0; i < whole.Size().ws_row; ++i)
+    data += GenerateLine(whole.Size().ws_col);
+  data += "\033[" + std::to_string(top) + ";" + std::to_string(bottom) + "r";
+  data += "\033[" + std::to_string(bottom) + ";1H";
+
+  for (size_t i = 0; i < kLineCount; ++i)
+    data += GenerateLine(whole.Size().ws_col);
+
+  whole.ProcessData(data.data(), data.size());
+  for (char ch : data) bytes.ProcessData(&ch, 1);
+
+  const std::vector<Terminal::State> expected = ReadHistory(&bytes);
+  const std::vector<Terminal::State> history = ReadHistory(&whole);
+  assert(history.size() == expected.size());
+
+  const std::string name = "scroll region " + std::to_string(top) + ";" +
+                           std::to_string(bottom);
+  for (size_t i = 0; i < history.size(); ++i)
+    Check(name.c_str(), history[i], expected[i],
+          "when written whole instead of one byte at a time");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  srand(time(NULL));
+
+  for (const auto& test : kCases) TestCase(test);
+
+  for (const auto& region : kScrollRegions) {
+    for (int i = 0; i < 10; ++i) TestScrollRegion(region.top, region.bottom);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,290 @@
+// Compares the poll and read loop TTYReadThread falls back to with the
+// io_uring backend, by pushing output through a pty as fast as possible and
+// counting the system calls the reading side makes.  Then does the same for
+// input, written in small pieces through the write queues of both backends,
+// and reports how deep the queue got.
+//
+// Usage: pty-bench [MEGABYTES]
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "base/async-writer.h"
+#include "uring-pty.h"
+
+namespace {
+
+// Same limits as TTYReadThread.
+const size_t kMinBufferSize = 4096;
+const size_t kMaxBufferSize = 4 << 20;
+
+// Same as kMaxQueuedInput in main.cc.
+const size_t kMaxQueuedInput = 1 << 20;
+
+// Size of the pieces input is written in.
+const size_t kInputPieceSize = 64;
+
+struct Result {
+  size_t bytes = 0;
+  uint64_t system_calls = 0;
+  size_t max_queued = 0;
+};
+
+// Opens a pty pair in raw mode, and starts writing `size' bytes of output to
+// the slave side, which is closed when done.
+std::thread StartWriter(int* master, size_t size) {
+  int slave;
+  if (-1 == openpty(master, &slave, nullptr, nullptr, nullptr))
+    err(EXIT_FAILURE, "openpty failed");
+
+  struct termios attributes;
+  tcgetattr(slave, &attributes);
+  cfmakeraw(&attributes);
+  tcsetattr(slave, TCSANOW, &attributes);
+
+  return std::thread([slave, size] {
+    std::string line;
+    for (size_t i = 0; line.size() < 65536; ++i)
+      line += "make[2]: Entering directory `/build/terminal-" +
+              std::to_string(i) + "'\r\n";
+
+    for (size_t written = 0; written < size;) {
+      ssize_t result =
+          write(slave, line.data(), std::min(line.size(), size - written));
+      if (result <= 0) err(EXIT_FAILURE, "write failed");
+      written += result;
+    }
+
+    close(slave);
+  });
+}
+
+// Reads the way TTYReadThread does without io_uring.
+Result ReadWithPoll(size_t size) {
+  int master;
+  std::thread writer = StartWriter(&master, size);
+  fcntl(master, F_SETFL, O_NDELAY);
+
+  Result result;
+  size_t buffer_size = kMinBufferSize;
+  std::unique_ptr<unsigned char[]> buf(new unsigned char[buffer_size]);
+  struct pollfd pfd{master, POLLIN | POLLRDHUP, 0};
+
+  for (;;) {
+    ++result.system_calls;
+    if (-1 == poll(&pfd, 1, -1)) err(EXIT_FAILURE, "poll failed");
+
+    size_t fill = 0;
+    ssize_t amount;
+    for (;;) {
+      ++result.system_calls;
+      amount = read(master, &buf[fill], buffer_size - fill);
+      if (amount <= 0) break;
+      fill += amount;
+      if (fill == buffer_size) break;
+    }
+    result.bytes += fill;
+
+    if (fill == buffer_size && buffer_size < kMaxBufferSize) {
+      buffer_size *= 2;
+      buf.reset(new unsigned char[buffer_size]);
+    } else if (fill < buffer_size / 4 && buffer_size > kMinBufferSize) {
+      buffer_size /= 2;
+      buf.reset(new unsigned char[buffer_size]);
+    }
+
+    if (!fill && (amount == 0 || errno != EAGAIN)) break;
+  }
+
+  writer.join();
+  close(master);
+
+  return result;
+}
+
+// Opens a pty pair in raw mode, and starts reading `size' bytes from the
+// slave side.
+std::thread StartReader(int* master, size_t size) {
+  int slave;
+  if (-1 == openpty(master, &slave, nullptr, nullptr, nullptr))
+    err(EXIT_FAILURE, "openpty failed");
+
+  struct termios attributes;
+  tcgetattr(slave, &attributes);
+  cfmakeraw(&attributes);
+  tcsetattr(slave, TCSANOW, &attributes);
+
+  fcntl(*master, F_SETFL, O_NDELAY);
+
+  return std::thread([slave, size] {
+    unsigned char buf[65536];
+    for (size_t done = 0; done < size;) {
+      ssize_t result = read(slave, buf, sizeof(buf));
+      if (result <= 0) err(EXIT_FAILURE, "read failed");
+      done += result;
+    }
+
+    close(slave);
+  });
+}
+
+// Writes `size' bytes of input in small pieces through `writer', keeping at
+// most kMaxQueuedInput bytes queued the way SendInput does.
+template <typename Writer>
+void WriteInput(Writer* writer, size_t size, Result* result) {
+  const std::string piece(kInputPieceSize, 'x');
+
+  while (result->bytes < size) {
+    if (writer->Queued() >= kMaxQueuedInput) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    const size_t amount = std::min(piece.size(), size - result->bytes);
+    writer->Write(piece.data(), amount);
+    result->bytes += amount;
+    result->max_queued = std::max(result->max_queued, writer->Queued());
+  }
+}
+
+Result WriteWithThread(size_t size) {
+  int master;
+  std::thread reader = StartReader(&master, size);
+
+  Result result;
+  std::atomic<uint64_t> writes(0);
+  {
+    AsyncWriter writer(master, [&writes](size_t) { ++writes; });
+    WriteInput(&writer, size, &result);
+  }
+  result.system_calls = writes;
+
+  reader.join();
+  close(master);
+
+  return result;
+}
+
+bool WriteWithURing(size_t size, Result* result) {
+  int master;
+  std::thread reader = StartReader(&master, size);
+
+  URingPty pty;
+  uint64_t writes = 0;
+  pty.SetWriteCallback([&writes](size_t) { ++writes; });
+  if (!pty.Open(master)) {
+    // Let the reader finish.
+    fcntl(master, F_SETFL, 0);
+    const std::string piece(65536, 'x');
+    for (size_t written = 0; written < size;) {
+      ssize_t result =
+          write(master, piece.data(), std::min(piece.size(), size - written));
+      if (result <= 0) err(EXIT_FAILURE, "write failed");
+      written += result;
+    }
+    reader.join();
+    close(master);
+    return false;
+  }
+
+  // Write completions are handled by Read, which would otherwise be called
+  // by TTYReadThread.
+  std::thread completer([&pty] {
+    while (0 <= pty.Read(-1, [](const iovec*, size_t) {}))
+      ;
+  });
+
+  WriteInput(&pty, size, result);
+
+  reader.join();
+  completer.join();
+  result->system_calls = writes;
+  close(master);
+
+  return true;
+}
+
+bool ReadWithURing(size_t size, Result* result) {
+  int master;
+  std::thread writer = StartWriter(&master, size);
+  fcntl(master, F_SETFL, O_NDELAY);
+
+  {
+    URingPty pty;
+    if (pty.Open(master)) {
+      while (0 <= pty.Read(-1, [result](const iovec* buffers, size_t count) {
+        for (size_t i = 0; i < count; ++i) result->bytes += buffers[i].iov_len;
+      }))
+        ;
+      result->system_calls = pty.SystemCalls();
+    } else {
+      warn("io_uring is not available");
+
+      // Let the writer finish.
+      fcntl(master, F_SETFL, 0);
+      unsigned char buf[65536];
+      while (0 < read(master, buf, sizeof(buf)))
+        ;
+    }
+  }
+
+  writer.join();
+  close(master);
+
+  return result->bytes > 0;
+}
+
+// Prints `result', of which `system_calls' counts `unit'.
+void Print(const char* name, const char* unit, const Result& result,
+           std::chrono::duration<double> elapsed) {
+  printf("%-14s %9.1f MB/s %10llu %-12s %8.1f per MB", name,
+         result.bytes / elapsed.count() / 1e6,
+         static_cast<unsigned long long>(result.system_calls), unit,
+         result.system_calls / (result.bytes / 1e6));
+  if (result.max_queued)
+    printf(" %8zu KB queued at most", result.max_queued >> 10);
+  printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t size = (argc > 1 ? strtoul(argv[1], nullptr, 0) : 256) << 20;
+
+  auto start = std::chrono::steady_clock::now();
+  Result poll_result = ReadWithPoll(size);
+  Print("poll", "system calls", poll_result,
+        std::chrono::steady_clock::now() - start);
+
+  start = std::chrono::steady_clock::now();
+  Result uring_result;
+  if (ReadWithURing(size, &uring_result))
+    Print("io_uring", "system calls", uring_result,
+          std::chrono::steady_clock::now() - start);
+
+  start = std::chrono::steady_clock::now();
+  Result thread_input_result = WriteWithThread(size);
+  Print("input thread", "writes", thread_input_result,
+        std::chrono::steady_clock::now() - start);
+
+  start = std::chrono::steady_clock::now();
+  Result uring_input_result;
+  if (WriteWithURing(size, &uring_input_result))
+    Print("input io_uring", "writes", uring_input_result,
+          std::chrono::steady_clock::now() - start);
+
+  return EXIT_SUCCESS;
+}
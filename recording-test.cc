@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "recording.h"
+
+namespace {
+
+struct Replay {
+  std::string output, input;
+  unsigned int columns = 0, rows = 0;
+  size_t resizes = 0;
+};
+
+// Reads the events of `recording' from its current position.
+Replay ReadEvents(RecordingReader* recording) {
+  Replay result;
+  RecordingReader::Event event;
+  uint64_t last_time = 0;
+
+  while (recording->Next(&event)) {
+    assert(event.time >= last_time);
+    last_time = event.time;
+
+    switch (event.type) {
+      case kRecordingOutput:
+        result.output.append(reinterpret_cast<const char*>(event.data),
+                             event.size);
+        break;
+
+      case kRecordingInput:
+        result.input.append(reinterpret_cast<const char*>(event.data),
+                            event.size);
+        break;
+
+      case kRecordingResize:
+        result.columns = event.columns;
+        result.rows = event.rows;
+        ++result.resizes;
+        break;
+    }
+  }
+
+  return result;
+}
+
+std::string ReadFile(const char* path) {
+  std::string result;
+  char buffer[65536];
+  ssize_t amount;
+
+  int fd = open(path, O_RDONLY);
+  assert(fd != -1);
+  while (0 < (amount = read(fd, buffer, sizeof(buffer))))
+    result.append(buffer, amount);
+  close(fd);
+
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* tmpdir = getenv("TMPDIR");
+  std::string path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") +
+                     "/recording-test.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  assert(fd != -1);
+  close(fd);
+
+  // Enough output for several blocks, with input and a resize half way.
+  std::string output, input;
+  {
+    RecordingWriter writer;
+    assert(writer.Open(path.c_str()));
+
+    writer.AddResize(80, 24);
+    for (size_t i = 0; i < 100000; ++i) {
+      const std::string line =
+          "line " + std::to_string(i * 7919 % 100003) + "\r\n";
+      writer.AddOutput(line.data(), line.size());
+      output += line;
+
+      if (i % 1000 == 0) {
+        const std::string key = std::to_string(i);
+        writer.AddInput(key.data(), key.size());
+        input += key;
+      }
+
+      if (i == 50000) writer.AddResize(132, 50);
+    }
+
+    writer.Close();
+    writer.Close();
+  }
+
+  const std::string data = ReadFile(path.c_str());
+  unlink(path.c_str());
+
+  assert(!RecordingReader::IsRecording(output.data(), output.size()));
+  assert(RecordingReader::IsRecording(data.data(), data.size()));
+
+  // Read in full, through the index.
+  RecordingReader recording;
+  assert(recording.Open(data.data(), data.size()));
+  const size_t block_count = recording.BlockCount();
+  assert(block_count > 2);
+
+  Replay replay = ReadEvents(&recording);
+  assert(replay.output == output);
+  assert(replay.input == input);
+  assert(replay.columns == 132 && replay.rows == 50);
+
+  for (size_t i = 0; i < block_count; ++i) {
+    assert(!i || recording.BlockTime(i) >= recording.BlockTime(i - 1));
+    const size_t found = recording.FindBlock(recording.BlockTime(i));
+    assert(found >= i);
+    assert(recording.BlockTime(found) == recording.BlockTime(i));
+  }
+  assert(recording.FindBlock(0) == 0);
+
+  // Every block starts with the terminal size, so replay can start there.
+  recording.Seek(block_count - 1);
+  RecordingReader::Event event;
+  assert(recording.Next(&event));
+  assert(event.type == kRecordingResize);
+  assert(event.columns == 132 && event.rows == 50);
+
+  recording.Seek(block_count - 1);
+  Replay tail = ReadEvents(&recording);
+  assert(!tail.output.empty());
+  assert(tail.output.size() < output.size());
+  assert(!output.compare(output.size() - tail.output.size(),
+                         tail.output.size(), tail.output));
+
+  // Without the index, the blocks are found by walking them.
+  const size_t block_data_size = data.size() - 24 - block_count * 16;
+  assert(!memcmp(&data[data.size() - 8], kRecordingIndexMagic, 8));
+  const std::string unindexed = data.substr(0, block_data_size);
+
+  RecordingReader unindexed_recording;
+  assert(unindexed_recording.Open(unindexed.data(), unindexed.size()));
+  assert(unindexed_recording.BlockCount() == block_count);
+  for (size_t i = 0; i < block_count; ++i)
+    assert(unindexed_recording.BlockTime(i) == recording.BlockTime(i));
+  replay = ReadEvents(&unindexed_recording);
+  assert(replay.output == output);
+  assert(replay.input == input);
+
+  // A recording cut short in the middle of a block loses only that block.
+  const std::string truncated = unindexed.substr(0, unindexed.size() - 1);
+  RecordingReader truncated_recording;
+  assert(truncated_recording.Open(truncated.data(), truncated.size()));
+  assert(truncated_recording.BlockCount() == block_count - 1);
+  replay = ReadEvents(&truncated_recording);
+  assert(replay.output.size() + tail.output.size() == output.size());
+  assert(!output.compare(0, replay.output.size(), replay.output));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+#include "recording.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+const char kRecordingMagic[8] = {'C', 'A', 'N', 'T', 'R', 'E', 'C', '1'};
+const char kRecordingIndexMagic[8] = {'C', 'A', 'N', 'T', 'I', 'D', 'X', '1'};
+
+namespace {
+
+// A block is ended once it holds this much data, or spans this many
+// microseconds, whichever comes first.
+const size_t kBlockSize = 256 << 10;
+const uint64_t kBlockDuration = 1000000;
+
+// Number of blocks that may wait for the writer thread before events have to
+// wait for it, which bounds memory use without dropping anything.
+const size_t kMaxQueuedBlocks = 64;
+
+const size_t kBlockHeaderSize = 16;
+const size_t kIndexEntrySize = 16;
+const size_t kIndexTrailerSize = 16 + sizeof(kRecordingIndexMagic);
+
+void PutVarint(std::string* output, uint64_t value) {
+  while (value >= 0x80) {
+    output->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  output->push_back(static_cast<char>(value));
+}
+
+bool GetVarint(const unsigned char** input, const unsigned char* end,
+               uint64_t* value) {
+  *value = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7) {
+    if (*input == end) return false;
+    const unsigned char byte = *(*input)++;
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+void PutLE(unsigned char* output, uint64_t value, size_t size) {
+  for (size_t i = 0; i < size; ++i) output[i] = value >> (8 * i);
+}
+
+uint64_t GetLE(const unsigned char* input, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; ++i)
+    value |= static_cast<uint64_t>(input[i]) << (8 * i);
+  return value;
+}
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* input = static_cast<const char*>(data);
+
+  while (size) {
+    const ssize_t result = write(fd, input, size);
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    input += result;
+    size -= result;
+  }
+
+  return true;
+}
+
+}  // namespace
+
+RecordingWriter::RecordingWriter()
+    : fd_(-1),
+      in_block_(false),
+      last_time_(),
+      columns_(),
+      rows_(),
+      closing_(false),
+      offset_() {}
+
+RecordingWriter::~RecordingWriter() { Close(); }
+
+bool RecordingWriter::Open(const char* path) {
+  fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd_ == -1) return false;
+
+  if (!WriteAll(fd_, kRecordingMagic, sizeof(kRecordingMagic))) {
+    const int saved_errno = errno;
+    close(fd_);
+    fd_ = -1;
+    errno = saved_errno;
+    return false;
+  }
+  offset_ = sizeof(kRecordingMagic);
+
+  start_ = std::chrono::steady_clock::now();
+  thread_ = std::thread(&RecordingWriter::Run, this);
+
+  return true;
+}
+
+void RecordingWriter::AddResize(unsigned int columns, unsigned int rows) {
+  std::string data;
+  PutVarint(&data, columns);
+  PutVarint(&data, rows);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  columns_ = columns;
+  rows_ = rows;
+  AddLocked(&lock, kRecordingResize, data.data(), data.size());
+}
+
+void RecordingWriter::Close() {
+  if (!thread_.joinable()) return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (in_block_) EndBlock();
+    closing_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+
+  close(fd_);
+  fd_ = -1;
+}
+
+void RecordingWriter::Add(RecordingEventType type, const void* data,
+                          size_t size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  AddLocked(&lock, type, data, size);
+}
+
+void RecordingWriter::AddLocked(std::unique_lock<std::mutex>* lock,
+                                RecordingEventType type, const void* data,
+                                size_t size) {
+  if (closing_ || fd_ == -1) return;
+
+  // Taken with the lock held, so that times never go backwards.
+  uint64_t time = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count();
+
+  if (in_block_ && (block_.data.size() >= kBlockSize ||
+                    time - block_.time >= kBlockDuration))
+    EndBlock();
+
+  if (!in_block_) {
+    taken_.wait(*lock, [this] {
+      return closing_ || full_blocks_.size() < kMaxQueuedBlocks;
+    });
+    if (closing_) return;
+
+    time = std::max(time, last_time_);
+    StartBlock(time);
+  }
+
+  block_.data.push_back(type);
+  PutVarint(&block_.data, time - last_time_);
+  PutVarint(&block_.data, size);
+  block_.data.append(static_cast<const char*>(data), size);
+  last_time_ = time;
+}
+
+void RecordingWriter::StartBlock(uint64_t time) {
+  block_.time = time;
+  block_.data.clear();
+  last_time_ = time;
+  in_block_ = true;
+
+  if (columns_) {
+    block_.data.push_back(kRecordingResize);
+    PutVarint(&block_.data, 0);
+
+    std::string size;
+    PutVarint(&size, columns_);
+    PutVarint(&size, rows_);
+    PutVarint(&block_.data, size.size());
+    block_.data += size;
+  }
+}
+
+void RecordingWriter::EndBlock() {
+  full_blocks_.emplace_back(std::move(block_));
+  block_ = Block();
+  in_block_ = false;
+  cond_.notify_one();
+}
+
+void RecordingWriter::Run() {
+  std::vector<unsigned char> output;
+  bool failed = false;
+
+  for (;;) {
+    Block block;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return closing_ || !full_blocks_.empty(); });
+      if (full_blocks_.empty()) break;
+      block = std::move(full_blocks_.front());
+      full_blocks_.pop_front();
+    }
+    taken_.notify_all();
+
+    // Blocks are still taken after a failure, so that nobody waits for them.
+    if (failed) continue;
+
+    uLongf compressed_size = compressBound(block.data.size());
+    output.resize(kBlockHeaderSize + compressed_size);
+
+    if (Z_OK != compress2(&output[kBlockHeaderSize], &compressed_size,
+                          reinterpret_cast<const Bytef*>(block.data.data()),
+                          block.data.size(), Z_BEST_SPEED)) {
+      failed = true;
+      continue;
+    }
+
+    PutLE(&output[0], compressed_size, 4);
+    PutLE(&output[4], block.data.size(), 4);
+    PutLE(&output[8], block.time, 8);
+
+    const size_t size = kBlockHeaderSize + compressed_size;
+    if (!WriteAll(fd_, output.data(), size)) {
+      failed = true;
+      continue;
+    }
+
+    index_.emplace_back(offset_, block.time);
+    offset_ += size;
+  }
+
+  if (failed) return;
+
+  output.resize(index_.size() * kIndexEntrySize + kIndexTrailerSize);
+  unsigned char* entry = output.data();
+  for (const auto& block : index_) {
+    PutLE(entry, block.first, 8);
+    PutLE(entry + 8, block.second, 8);
+    entry += kIndexEntrySize;
+  }
+  PutLE(entry, offset_, 8);
+  PutLE(entry + 8, index_.size(), 8);
+  memcpy(entry + 16, kRecordingIndexMagic, sizeof(kRecordingIndexMagic));
+
+  WriteAll(fd_, output.data(), output.size());
+}
+
+bool RecordingReader::IsRecording(const void* data, size_t size) {
+  return size >= sizeof(kRecordingMagic) &&
+         !memcmp(data, kRecordingMagic, sizeof(kRecordingMagic));
+}
+
+bool RecordingReader::Open(const void* data, size_t size) {
+  if (!IsRecording(data, size)) return false;
+
+  data_ = static_cast<const unsigned char*>(data);
+  size_ = size;
+  blocks_.clear();
+  Seek(0);
+
+  if (size_ >= sizeof(kRecordingMagic) + kIndexTrailerSize &&
+      !memcmp(data_ + size_ - sizeof(kRecordingIndexMagic),
+              kRecordingIndexMagic, sizeof(kRecordingIndexMagic))) {
+    const unsigned char* trailer = data_ + size_ - kIndexTrailerSize;
+    const uint64_t index_offset = GetLE(trailer, 8);
+    const uint64_t count = GetLE(trailer + 8, 8);
+
+    if (index_offset < sizeof(kRecordingMagic) ||
+        index_offset > size_ - kIndexTrailerSize ||
+        count != (size_ - kIndexTrailerSize - index_offset) / kIndexEntrySize)
+      return false;
+
+    for (uint64_t i = 0; i < count; ++i) {
+      const unsigned char* entry = data_ + index_offset + i * kIndexEntrySize;
+      blocks_.emplace_back(GetLE(entry, 8), GetLE(entry + 8, 8));
+      if (blocks_.back().first + kBlockHeaderSize > index_offset) return false;
+    }
+
+    return true;
+  }
+
+  // The recording was not closed, so find the blocks that were written in
+  // full.
+  for (size_t offset = sizeof(kRecordingMagic);
+       offset + kBlockHeaderSize <= size_;) {
+    const size_t block_size =
+        kBlockHeaderSize + GetLE(data_ + offset, 4);
+    if (block_size > size_ - offset) break;
+
+    blocks_.emplace_back(offset, GetLE(data_ + offset + 8, 8));
+    offset += block_size;
+  }
+
+  return true;
+}
+
+size_t RecordingReader::FindBlock(uint64_t time) const {
+  auto block = std::upper_bound(
+      blocks_.begin(), blocks_.end(), time,
+      [](uint64_t time, const std::pair<uint64_t, uint64_t>& block) {
+        return time < block.second;
+      });
+
+  return block == blocks_.begin() ? 0 : block - blocks_.begin() - 1;
+}
+
+void RecordingReader::Seek(size_t index) {
+  next_block_ = index;
+  block_.clear();
+  block_offset_ = 0;
+}
+
+bool RecordingReader::Next(Event* event) {
+  while (block_offset_ == block_.size()) {
+    if (next_block_ == blocks_.size() || !ReadBlock()) return false;
+  }
+
+  const unsigned char* input =
+      reinterpret_cast<const unsigned char*>(block_.data()) + block_offset_;
+  const unsigned char* end =
+      reinterpret_cast<const unsigned char*>(block_.data()) + block_.size();
+
+  uint64_t delta, size;
+  event->type = static_cast<RecordingEventType>(*input++);
+  if (!GetVarint(&input, end, &delta) || !GetVarint(&input, end, &size) ||
+      size > static_cast<size_t>(end - input))
+    return false;
+
+  time_ += delta;
+  event->time = time_;
+  event->data = input;
+  event->size = size;
+  event->columns = 0;
+  event->rows = 0;
+
+  if (event->type == kRecordingResize) {
+    const unsigned char* payload = input;
+    uint64_t columns, rows;
+    if (!GetVarint(&payload, input + size, &columns) ||
+        !GetVarint(&payload, input + size, &rows))
+      return false;
+    event->columns = columns;
+    event->rows = rows;
+  }
+
+  block_offset_ = input + size - reinterpret_cast<const unsigned char*>(
+                                     block_.data());
+
+  return true;
+}
+
+bool RecordingReader::ReadBlock() {
+  const uint64_t offset = blocks_[next_block_].first;
+  const unsigned char* header = data_ + offset;
+
+  const size_t compressed_size = GetLE(header, 4);
+  uLongf size = GetLE(header + 4, 4);
+  if (compressed_size > size_ - offset - kBlockHeaderSize) return false;
+
+  block_.resize(size);
+  if (Z_OK != uncompress(reinterpret_cast<Bytef*>(&block_[0]), &size,
+                         header + kBlockHeaderSize, compressed_size) ||
+      size != block_.size())
+    return false;
+
+  time_ = GetLE(header + 8, 8);
+  block_offset_ = 0;
+  ++next_block_;
+
+  return true;
+}
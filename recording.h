@@ -0,0 +1,177 @@
+#ifndef RECORDING_H_
+#define RECORDING_H_ 1
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A session recorded with `cantera-term --record', for cantera-replay.
+//
+// The file starts with kRecordingMagic, followed by blocks of events.  Each
+// block is a header of three little-endian integers, the compressed size
+// (32 bits), the uncompressed size (32 bits) and the time of the block in
+// microseconds since the start of the recording (64 bits), followed by the
+// events compressed with zlib.  Each event is a type byte, the microseconds
+// since the previous event, or the block time for the first one, and the
+// size of its data as varints, and the data.  A block starts with the
+// terminal size, so replay can start from any block.
+//
+// Closing the recording appends an index of the offset and time of every
+// block, as pairs of 64-bit integers, followed by the offset of the index,
+// the number of blocks, both 64 bits, and kRecordingIndexMagic.  A recording
+// that was never closed has no index, and is read by walking the blocks.
+
+extern const char kRecordingMagic[8];
+extern const char kRecordingIndexMagic[8];
+
+enum RecordingEventType : uint8_t {
+  // Output from the pty.
+  kRecordingOutput = 1,
+
+  // Input written to the pty.
+  kRecordingInput = 2,
+
+  // New terminal size, as varints of the columns and rows.
+  kRecordingResize = 3,
+};
+
+// Writes a recording.  Events are compressed and written from a thread of
+// its own, so that recording slows the terminal down as little as possible.
+// Every method may be called from any thread.
+class RecordingWriter {
+ public:
+  RecordingWriter();
+  ~RecordingWriter();
+
+  RecordingWriter(const RecordingWriter&) = delete;
+  RecordingWriter& operator=(const RecordingWriter&) = delete;
+
+  // Creates the recording at `path'.  Returns false and sets errno on
+  // failure.
+  bool Open(const char* path);
+
+  void AddOutput(const void* data, size_t size) {
+    Add(kRecordingOutput, data, size);
+  }
+  void AddInput(const void* data, size_t size) {
+    Add(kRecordingInput, data, size);
+  }
+  void AddResize(unsigned int columns, unsigned int rows);
+
+  // Writes the events added so far and the index, and closes the file.
+  void Close();
+
+ private:
+  struct Block {
+    uint64_t time;
+    std::string data;
+  };
+
+  void Add(RecordingEventType type, const void* data, size_t size);
+
+  // Adds an event with `lock' held on `mutex_'.  May wait for the writer
+  // thread, with the lock released, if too many blocks are queued.
+  void AddLocked(std::unique_lock<std::mutex>* lock, RecordingEventType type,
+                 const void* data, size_t size);
+
+  // Starts a new block with the current terminal size.  Must be called with
+  // `mutex_' held.
+  void StartBlock(uint64_t time);
+
+  // Hands the current block to the writer thread.  Must be called with
+  // `mutex_' held.
+  void EndBlock();
+
+  // Compresses and writes blocks until Close is called.
+  void Run();
+
+  int fd_;
+
+  std::chrono::steady_clock::time_point start_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+
+  // Signaled when the writer thread takes a block.
+  std::condition_variable taken_;
+
+  // Block being filled, time of the last event, and the latest terminal
+  // size, which every block starts with.
+  Block block_;
+  bool in_block_;
+  uint64_t last_time_;
+  unsigned int columns_, rows_;
+
+  // Blocks waiting to be written.
+  std::deque<Block> full_blocks_;
+  bool closing_;
+
+  // Offset and time of every block written, for the index.  Only used by
+  // the writer thread.
+  std::vector<std::pair<uint64_t, uint64_t>> index_;
+  uint64_t offset_;
+
+  std::thread thread_;
+};
+
+// Reads a recording held in memory.
+class RecordingReader {
+ public:
+  struct Event {
+    RecordingEventType type;
+
+    // Microseconds since the start of the recording.
+    uint64_t time;
+
+    // Data of output and input events.
+    const unsigned char* data;
+    size_t size;
+
+    // Size given by resize events.
+    unsigned int columns, rows;
+  };
+
+  // Returns true if `data' starts like a recording.
+  static bool IsRecording(const void* data, size_t size);
+
+  // Reads the `size' bytes of the recording at `data', which must stay
+  // valid.  Returns false if it is corrupt.
+  bool Open(const void* data, size_t size);
+
+  // Number of blocks, and the time of each.
+  size_t BlockCount() const { return blocks_.size(); }
+  uint64_t BlockTime(size_t index) const { return blocks_[index].second; }
+
+  // Returns the last block that starts at or before `time', or 0.
+  size_t FindBlock(uint64_t time) const;
+
+  // Continues reading at the start of block `index'.
+  void Seek(size_t index);
+
+  // Reads the next event into `event'.  Returns false at the end of the
+  // recording, or if it is corrupt.
+  bool Next(Event* event);
+
+ private:
+  // Decompresses block `next_block_'.  Returns false if it is corrupt.
+  bool ReadBlock();
+
+  const unsigned char* data_ = nullptr;
+  size_t size_ = 0;
+
+  // Offset and time of every block.
+  std::vector<std::pair<uint64_t, uint64_t>> blocks_;
+
+  size_t next_block_ = 0;
+  std::string block_;
+  size_t block_offset_ = 0;
+  uint64_t time_ = 0;
+};
+
+#endif  // !RECORDING_H_
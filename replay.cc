@@ -0,0 +1,246 @@
+// Replays a capture made with `cantera-term --tty-log` or `--record` through
+// Terminal, without X or GL, and reports how long it took.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "recording.h"
+#include "terminal.h"
+
+namespace {
+
+int print_version;
+int print_help;
+int realtime;
+
+struct option long_options[] = {
+    {"columns", required_argument, 0, 'c'},
+    {"rows", required_argument, 0, 'r'},
+    {"history-size", required_argument, 0, 'H'},
+    {"snapshot-interval", required_argument, 0, 's'},
+    {"rate", required_argument, 0, 'R'},
+    {"start", required_argument, 0, 'S'},
+    {"realtime", no_argument, &realtime, 1},
+    {"version", no_argument, &print_version, 1},
+    {"help", no_argument, &print_help, 1},
+    {0, 0, 0, 0}};
+
+// The same chunk size TTYReadThread reads from the pty.
+const size_t kChunkSize = 4096;
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  unsigned int columns = 80, rows = 24;
+  size_t history_size = 1000;
+  size_t snapshot_interval = 0;
+  double rate = 0;
+  double start_time = 0;
+  int i;
+
+  while ((i = getopt_long(argc, argv, "c:r:H:s:R:S:", long_options, 0)) !=
+         -1) {
+    switch (i) {
+      case 0:
+        break;
+
+      case 'c':
+        columns = std::max(1L, strtol(optarg, nullptr, 0));
+        break;
+
+      case 'r':
+        rows = std::max(1L, strtol(optarg, nullptr, 0));
+        break;
+
+      case 'H':
+        history_size = strtoul(optarg, nullptr, 0);
+        break;
+
+      case 's':
+        snapshot_interval = strtoul(optarg, nullptr, 0);
+        break;
+
+      case 'R':
+        rate = strtod(optarg, nullptr);
+        break;
+
+      case 'S':
+        start_time = strtod(optarg, nullptr);
+        break;
+
+      case '?':
+
+        fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
+
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (print_help) {
+    printf(
+        "Usage: %s [OPTION]... LOG\n"
+        "\n"
+        "  -c, --columns=N            terminal width in characters [80]\n"
+        "  -r, --rows=N               terminal height in lines [24]\n"
+        "  -H, --history-size=N       lines of scrollback [1000]\n"
+        "  -s, --snapshot-interval=N  call UpdateState every N bytes\n"
+        "  -R, --rate=BYTES           replay at most BYTES bytes per second\n"
+        "                             instead of at full speed\n"
+        "  -S, --start=SECONDS        start a recording from the block at\n"
+        "                             SECONDS\n"
+        "      --realtime             replay a recording at the speed it was\n"
+        "                             recorded\n"
+        "      --help     display this help and exit\n"
+        "      --version  display version information\n"
+        "\n"
+        "Report bugs to <morten.hustveit@gmail.com>\n",
+        argv[0]);
+
+    return EXIT_SUCCESS;
+  }
+
+  if (print_version) {
+    fprintf(stdout, "%s\n", PACKAGE_STRING);
+
+    return EXIT_SUCCESS;
+  }
+
+  if (optind + 1 != argc)
+    errx(EXIT_FAILURE, "Usage: %s [OPTION]... LOG", argv[0]);
+
+  int fd;
+  if (-1 == (fd = open(argv[optind], O_RDONLY)))
+    err(EXIT_FAILURE, "Failed to open log file `%s'", argv[optind]);
+
+  struct stat st;
+  if (-1 == fstat(fd, &st)) err(EXIT_FAILURE, "fstat failed");
+
+  const size_t size = st.st_size;
+  const unsigned char* data = nullptr;
+
+  if (size) {
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) err(EXIT_FAILURE, "mmap failed");
+    madvise(map, size, MADV_SEQUENTIAL);
+    data = reinterpret_cast<const unsigned char*>(map);
+  }
+
+  close(fd);
+
+  RecordingReader recording;
+  const bool is_recording = RecordingReader::IsRecording(data, size);
+  if (is_recording) {
+    if (!recording.Open(data, size))
+      errx(EXIT_FAILURE, "Recording `%s' is corrupt", argv[optind]);
+
+    if (start_time > 0)
+      recording.Seek(recording.FindBlock(start_time * 1e6));
+  }
+
+  Terminal terminal([](const void* data, size_t size) {});
+  terminal.Init(columns, rows, 1, 1, history_size);
+
+  Terminal::State state;
+  size_t snapshots = 0;
+  std::chrono::duration<double> snapshot_time(0);
+  size_t next_snapshot = snapshot_interval;
+  size_t processed = 0, input = 0, resizes = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+
+  auto process = [&](const unsigned char* data, size_t size) {
+    for (size_t offset = 0; offset < size;) {
+      size_t amount = std::min(kChunkSize, size - offset);
+      if (snapshot_interval)
+        amount = std::min(amount, next_snapshot - processed);
+
+      terminal.ProcessData(data + offset, amount);
+      offset += amount;
+      processed += amount;
+
+      if (snapshot_interval && processed == next_snapshot) {
+        const auto snapshot_start = std::chrono::steady_clock::now();
+        terminal.UpdateState(&state);
+        snapshot_time += std::chrono::steady_clock::now() - snapshot_start;
+        ++snapshots;
+        next_snapshot += snapshot_interval;
+      }
+
+      if (rate > 0) {
+        std::this_thread::sleep_until(
+            start +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(processed / rate)));
+      }
+    }
+  };
+
+  if (is_recording) {
+    RecordingReader::Event event;
+    bool first = true;
+    uint64_t first_time = 0;
+
+    while (recording.Next(&event)) {
+      if (first) {
+        first_time = event.time;
+        first = false;
+      }
+
+      if (realtime) {
+        std::this_thread::sleep_until(
+            start + std::chrono::microseconds(event.time - first_time));
+      }
+
+      switch (event.type) {
+        case kRecordingOutput:
+          process(event.data, event.size);
+          break;
+
+        case kRecordingInput:
+          input += event.size;
+          break;
+
+        case kRecordingResize:
+          terminal.Resize(std::max(1U, event.columns),
+                          std::max(1U, event.rows), 1, 1);
+          ++resizes;
+          break;
+      }
+    }
+  } else {
+    process(data, size);
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%zu bytes in %.3f s: %.1f MB/s, %.2f ns/byte, %llu scrolls\n",
+         processed, elapsed.count(), processed / elapsed.count() / 1e6,
+         elapsed.count() * 1e9 / std::max(processed, size_t(1)),
+         static_cast<unsigned long long>(terminal.ScrollCount()));
+
+  if (is_recording) {
+    printf("%zu blocks, %zu bytes of input, %zu resizes\n",
+           recording.BlockCount(), input, resizes);
+  }
+
+  if (snapshots) {
+    printf("%zu snapshots: %.2f us per UpdateState\n", snapshots,
+           snapshot_time.count() * 1e6 / snapshots);
+  }
+
+  return EXIT_SUCCESS;
+}
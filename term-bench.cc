@@ -0,0 +1,187 @@
+// Measures the throughput of Terminal::ProcessData on synthetic and recorded
+// output.
+//
+// Usage: term-bench [FILE]...
+//
+// Every built-in scenario is run first, followed by each FILE (for example a
+// capture made with `cantera-term --tty-log`).
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+
+#include "base/string.h"
+#include "terminal.h"
+
+namespace {
+
+// The same chunk size TTYReadThread reads from the pty.
+const size_t kChunkSize = 4096;
+
+// Minimum number of input bytes to process per scenario.
+const size_t kMinBytes = 64 << 20;
+
+const char* kWords[] = {"configure", "libtool", "terminal.cc", "-Wall",
+                        "x86_64",    "-O2",     "make[2]:",    "Entering",
+                        "directory", "CXX",     "CCLD",        "warning:"};
+
+const char* kUTF8Words[] = {"blåbærsyltetøy", "Ærlig",  "Привет", "мир",
+                            "日本語",         "テキスト", "αβγδε",   "→",
+                            "│",              "✓",      "Größe",  "naïve"};
+
+std::string GenerateASCII() {
+  std::string result;
+
+  for (size_t line = 0; result.size() < (1 << 20); ++line) {
+    size_t length = 20 + line * 7 % 100;
+    for (size_t i = 0; i < length; ++i)
+      result.push_back(' ' + (line * 31 + i * 7) % 95);
+    result += "\r\n";
+  }
+
+  return result;
+}
+
+std::string GenerateSGR() {
+  static const char* kColors[] = {"01;34", "01;32", "01;36", "40;33;01",
+                                  "01;35", "00",    "01;31", "30;42"};
+  std::string result;
+
+  for (size_t line = 0; result.size() < (1 << 20); ++line) {
+    for (size_t i = 0; i < 6; ++i) {
+      size_t n = line * 6 + i;
+      result += StringPrintf("\033[0m\033[%sm%s\033[0m  ", kColors[n % 8],
+                             kWords[n % 12]);
+    }
+    result += "\r\n";
+  }
+
+  return result;
+}
+
+std::string GenerateUTF8() {
+  std::string result;
+
+  for (size_t line = 0; result.size() < (1 << 20); ++line) {
+    for (size_t i = 0; i < 8; ++i) {
+      result += kUTF8Words[(line * 5 + i) % 12];
+      result.push_back(' ');
+    }
+    result += "\r\n";
+  }
+
+  return result;
+}
+
+// Text inserted and scrolled inside a scroll region, the way vim and less
+// update the screen with a status line below the region.
+std::string GenerateScrollRegion() {
+  std::string result = "\033[1;40r";
+
+  for (size_t line = 0; result.size() < (1 << 20); ++line) {
+    if (line % 4 == 3) {
+      // Scroll backwards from the top of the region.
+      result += "\033[1;1H\033M";
+    } else {
+      result += "\033[40;1H\n";
+    }
+    result += StringPrintf("%5zu %s %s %s\033[K", line, kWords[line % 12],
+                           kWords[(line + 3) % 12], kWords[(line + 7) % 12]);
+    result += StringPrintf("\033[50;1H\033[7m-- line %zu --\033[27m\033[K",
+                           line);
+  }
+
+  return result + "\033[r";
+}
+
+// Plain lines appended at the bottom of a scroll region, like `tail -f' in
+// one pane of a split layout.
+std::string GenerateRegionLines() {
+  std::string result = "\033[1;40r\033[40;1H";
+
+  for (size_t line = 0; result.size() < (1 << 20); ++line) {
+    result += StringPrintf("%5zu %s %s %s\r\n", line, kWords[line % 12],
+                           kWords[(line + 3) % 12], kWords[(line + 7) % 12]);
+  }
+
+  return result + "\033[r";
+}
+
+// Full screen redraws with absolute cursor positioning, like htop.
+std::string GenerateRedraw() {
+  std::string result;
+
+  for (size_t frame = 0; result.size() < (1 << 20); ++frame) {
+    result += "\033[H";
+    for (size_t row = 1; row <= 50; ++row) {
+      result += StringPrintf("\033[%zu;1H\033[%um%5zu\033[0m \033[32m", row,
+                             30 + (unsigned)(row % 8), frame * 50 + row);
+      for (size_t i = 0; i < 40; ++i)
+        result.push_back(i < (frame + row) % 40 ? '|' : ' ');
+      result += StringPrintf("\033[0m %s\033[K", kWords[(frame + row) % 12]);
+    }
+  }
+
+  return result;
+}
+
+bool ReadFile(const char* path, std::string* result) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return false;
+
+  char buffer[65536];
+  size_t amount;
+  while (0 < (amount = fread(buffer, 1, sizeof(buffer), file)))
+    result->append(buffer, amount);
+
+  fclose(file);
+
+  return true;
+}
+
+void Run(const char* name, const std::string& corpus) {
+  if (corpus.empty()) return;
+
+  Terminal terminal([](const void* data, size_t size) {});
+  terminal.Init(1600, 1000, 10, 20, 1000);
+
+  size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  while (total < kMinBytes) {
+    for (size_t offset = 0; offset < corpus.size(); offset += kChunkSize) {
+      terminal.ProcessData(&corpus[offset],
+                           std::min(kChunkSize, corpus.size() - offset));
+    }
+    total += corpus.size();
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%-16s %9.1f MB/s %8.2f ns/byte %12.0f scrolls/s\n", name,
+         total / elapsed.count() / 1e6, elapsed.count() * 1e9 / total,
+         terminal.ScrollCount() / elapsed.count());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Run("ascii", GenerateASCII());
+  Run("sgr", GenerateSGR());
+  Run("utf-8", GenerateUTF8());
+  Run("scroll-region", GenerateScrollRegion());
+  Run("region-lines", GenerateRegionLines());
+  Run("redraw", GenerateRedraw());
+
+  for (int i = 1; i < argc; ++i) {
+    std::string corpus;
+    if (!ReadFile(argv[i], &corpus)) err(EXIT_FAILURE, "%s", argv[i]);
+    Run(argv[i], corpus);
+  }
+
+  return EXIT_SUCCESS;
+}
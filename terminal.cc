@@ -3,14 +3,356 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <algorithm>
 #include <memory>
+#include <new>
 
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace {
 
+// Returns the length of the run of printable ASCII characters (' ' through
+// '~') at the start of `data`, up to `max`.
+size_t PrintableRunLength(const unsigned char* data, size_t max) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // Bytes above 0x7f are negative as signed chars, so two signed comparisons
+  // are enough.
+  const __m128i lower = _mm_set1_epi8(' ' - 1);
+  const __m128i upper = _mm_set1_epi8('~' + 1);
+
+  for (; i + 16 <= max; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i printable =
+        _mm_and_si128(_mm_cmpgt_epi8(v, lower), _mm_cmplt_epi8(v, upper));
+    unsigned int mask = _mm_movemask_epi8(printable);
+    if (mask != 0xffff) return i + __builtin_ctz(~mask);
+  }
+#endif
+
+  while (i < max && data[i] >= ' ' && data[i] <= '~') ++i;
+
+  return i;
+}
+
+// Widens `count` ASCII characters into cells with attribute `attr`.
+void WidenASCII(Terminal::Cell* output, const unsigned char* input,
+                size_t count, uint32_t attr) {
+  size_t i = 0;
+
+#if defined(__SSE2__) && __SIZEOF_WCHAR_T__ == 4
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i attrs = _mm_set1_epi32(attr);
+
+  for (; i + 16 <= count; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i chars[4] = {
+        _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+        _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+    __m128i* out = reinterpret_cast<__m128i*>(output + i);
+    for (size_t j = 0; j < 4; ++j) {
+      _mm_storeu_si128(out + j * 2, _mm_unpacklo_epi32(chars[j], attrs));
+      _mm_storeu_si128(out + j * 2 + 1, _mm_unpackhi_epi32(chars[j], attrs));
+    }
+  }
+#endif
+
+  for (; i < count; ++i) output[i] = Terminal::Cell{input[i], attr};
+}
+
+// Returns the number of the `width' cells at `cells' that come before the
+// trailing run of cells identical to the last one.
+size_t TrimmedLength(const Terminal::Cell* cells, size_t width) {
+  const Terminal::Cell fill = cells[width - 1];
+  size_t count = width - 1;
+
+#if defined(__SSE2__) && __SIZEOF_WCHAR_T__ == 4
+  const __m128i fills = _mm_set_epi32(fill.attr, fill.ch, fill.attr, fill.ch);
+
+  for (; count >= 4; count -= 4) {
+    const __m128i* v = reinterpret_cast<const __m128i*>(cells + count - 4);
+    __m128i same = _mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128(v), fills),
+                                 _mm_cmpeq_epi32(_mm_loadu_si128(v + 1), fills));
+    if (_mm_movemask_epi8(same) != 0xffff) break;
+  }
+#endif
+
+  while (count && cells[count - 1].ch == fill.ch &&
+         cells[count - 1].attr == fill.attr)
+    --count;
+
+  return count;
+}
+
+// Narrows `count' cells into one byte per character at `output', as long as
+// all of them have attribute `attr' and characters up to 0xff.  Otherwise
+// returns false, with `output' partly written.
+bool NarrowCells(unsigned char* output, const Terminal::Cell* cells,
+                 size_t count, uint32_t attr) {
+  size_t i = 0;
+
+#if defined(__SSE2__) && __SIZEOF_WCHAR_T__ == 4
+  // Characters are compared with their low byte cleared, so each cell matches
+  // `expected' exactly when it can be narrowed.
+  const __m128i check = _mm_set_epi32(-1, ~0xff, -1, ~0xff);
+  const __m128i expected = _mm_set_epi32(attr, 0, attr, 0);
+  const __m128i low_bytes = _mm_set_epi32(0, 0xff, 0, 0xff);
+  __m128i match = _mm_set1_epi8(-1);
+
+  for (; i + 16 <= count; i += 16) {
+    const __m128i* in = reinterpret_cast<const __m128i*>(cells + i);
+    __m128i chars[8];
+    for (size_t j = 0; j < 8; ++j) {
+      __m128i v = _mm_loadu_si128(in + j);
+      match = _mm_and_si128(
+          match, _mm_cmpeq_epi32(_mm_and_si128(v, check), expected));
+      chars[j] = _mm_and_si128(v, low_bytes);
+    }
+
+    // Every other 16-bit, and then byte, lane of the packed values is zero.
+    __m128i words[2];
+    for (size_t j = 0; j < 2; ++j) {
+      words[j] = _mm_packus_epi16(
+          _mm_packs_epi32(chars[j * 4], chars[j * 4 + 1]),
+          _mm_packs_epi32(chars[j * 4 + 2], chars[j * 4 + 3]));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i),
+                     _mm_packus_epi16(words[0], words[1]));
+  }
+
+  if (_mm_movemask_epi8(match) != 0xffff) return false;
+#endif
+
+  uint32_t mismatch = 0;
+  for (; i < count; ++i) {
+    mismatch |= (cells[i].ch & ~0xffu) | (cells[i].attr ^ attr);
+    output[i] = cells[i].ch;
+  }
+
+  return !mismatch;
+}
+
+// Decodes printable ASCII and well-formed two and three byte UTF-8 sequences
+// from `*input` into cells with attribute `attr` at `output`, writing at most
+// `max` characters.  Stops at control characters, four byte sequences,
+// malformed input and sequences split by `end`, all of which are left to the
+// byte-at-a-time parser.
+// Returns the number of characters written and advances `*input`.
+size_t DecodeUTF8(const unsigned char** input, const unsigned char* end,
+                  Terminal::Cell* output, size_t max, uint32_t attr) {
+  const unsigned char* i = *input;
+  size_t count = 0;
+
+  while (count < max && i != end) {
+    if (*i < 0x80) {
+      size_t length = PrintableRunLength(
+          i, std::min(static_cast<size_t>(end - i), max - count));
+      if (!length) break;
+
+      WidenASCII(output + count, i, length, attr);
+      count += length;
+      i += length;
+    } else if (*i >= 0xc2 && *i < 0xe0) {
+      if (end - i < 2 || (i[1] & 0xc0) != 0x80) break;
+
+      output[count++] = Terminal::Cell{((i[0] & 0x1f) << 6) | (i[1] & 0x3f),
+                                       attr};
+      i += 2;
+    } else if (*i >= 0xe0 && *i < 0xf0) {
+      if (end - i < 3 || (i[1] & 0xc0) != 0x80 || (i[2] & 0xc0) != 0x80)
+        break;
+
+      unsigned int ch =
+          ((i[0] & 0x0f) << 12) | ((i[1] & 0x3f) << 6) | (i[2] & 0x3f);
+
+      // Reject overlong encodings and UTF-16 surrogates.
+      if (ch < 0x800 || (ch >= 0xd800 && ch < 0xe000)) break;
+
+      output[count++] = Terminal::Cell{static_cast<Terminal::CharacterType>(ch),
+                                       attr};
+      i += 3;
+    } else {
+      break;
+    }
+  }
+
+  *input = i;
+
+  return count;
+}
+
+// Returns a key identifying `attr` in Terminal::attr_indexes_.
+uint64_t AttrKey(const Terminal::Attr& attr) {
+  return static_cast<uint64_t>(attr.fg.r) << 48 |
+         static_cast<uint64_t>(attr.fg.g) << 40 |
+         static_cast<uint64_t>(attr.fg.b) << 32 |
+         static_cast<uint64_t>(attr.bg.r) << 24 | attr.bg.g << 16 |
+         attr.bg.b << 8 | attr.extra;
+}
+
+// Size of the attribute table at which unreferenced attributes are dropped,
+// at least.
+const size_t kMinAttrsLimit = 1024;
+
+// Number of history lines above the screen kept uncompressed.  Compression
+// is for long histories, so the default of 1000 lines is never compressed.
+const size_t kHotHistory = 1024;
+
+// Number of lines past kHotHistory that stay uncompressed until they are all
+// compressed at once, so that scrolling only stops to compress lines once
+// every kFreezeBatch lines.
+const size_t kFreezeBatch = 64;
+
+// Cold lines are encoded as:
+//
+//   varint  2 * N + W, where N is the number of cells before the trailing run
+//           of identical cells, and W is set if any of their characters is
+//           above 0xff
+//   cell    the trailing cell, repeated to the end of the line, as a varint
+//           character followed by its attribute
+//   runs    (varint length, attribute) pairs covering the first N cells
+//   chars   the characters of the first N cells, as bytes unless W is set,
+//           and as varints otherwise
+//
+// where an attribute is stored as its seven bytes.
+const size_t kMaxVarintSize = 5;
+const size_t kAttrSize = 7;
+
+unsigned char* PutVarint(unsigned char* output, uint32_t value) {
+  while (value >= 0x80) {
+    *output++ = value | 0x80;
+    value >>= 7;
+  }
+  *output++ = value;
+  return output;
+}
+
+uint32_t GetVarint(const unsigned char** input) {
+  uint32_t result = 0;
+  for (unsigned int shift = 0;; shift += 7) {
+    unsigned char byte = *(*input)++;
+    result |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return result;
+  }
+}
+
+unsigned char* PutAttr(unsigned char* output, const Terminal::Attr& attr) {
+  output[0] = attr.fg.r;
+  output[1] = attr.fg.g;
+  output[2] = attr.fg.b;
+  output[3] = attr.bg.r;
+  output[4] = attr.bg.g;
+  output[5] = attr.bg.b;
+  output[6] = attr.extra;
+  return output + kAttrSize;
+}
+
+// Encodes a line of nothing but `ch' with attribute `attr'.
+unsigned char* PutBlankLine(unsigned char* output, Terminal::CharacterType ch,
+                            const Terminal::Attr& attr) {
+  output = PutVarint(output, 0);
+  output = PutVarint(output, ch);
+  return PutAttr(output, attr);
+}
+
+const size_t kMaxBlankLineSize = kMaxVarintSize * 2 + kAttrSize;
+
+Terminal::Attr GetAttr(const unsigned char** input) {
+  const unsigned char* i = *input;
+  *input += kAttrSize;
+  return Terminal::Attr(Terminal::Color(i[0], i[1], i[2]),
+                        Terminal::Color(i[3], i[4], i[5]), i[6]);
+}
+
+// Returns the bytes of cold line `line', or nullptr if it is blank.
+const unsigned char* LineData(const std::string* line) {
+  return line ? reinterpret_cast<const unsigned char*>(line->data()) : nullptr;
+}
+
+// Allocates `count' zeroed elements.  Unlike new and std::fill, calloc leaves
+// large arrays in shared zero pages until they are written to.
+template <typename T>
+T* ZeroedArray(size_t count) {
+  void* result = calloc(count, sizeof(T));
+  if (!result) throw std::bad_alloc();
+  return static_cast<T*>(result);
+}
+
+// Decodes a cold line into `width' cells of `chars' and, unless null, `attr'.
+// Lines spilled to the history file before a resize may be wider or narrower
+// than `width'.
+void DecodeColdLine(const unsigned char* input, size_t width,
+                    Terminal::CharacterType* chars, Terminal::Attr* attr) {
+  size_t count = GetVarint(&input);
+  bool wide = count & 1;
+  count >>= 1;
+  Terminal::CharacterType fill_char = GetVarint(&input);
+  Terminal::Attr fill_attr = GetAttr(&input);
+
+  for (size_t i = 0; i < count;) {
+    size_t length = GetVarint(&input);
+    Terminal::Attr run_attr = GetAttr(&input);
+    if (attr && i < width)
+      std::fill_n(attr + i, std::min(length, width - i), run_attr);
+    i += length;
+  }
+
+  if (wide) {
+    for (size_t i = 0; i < count; ++i) {
+      Terminal::CharacterType ch = GetVarint(&input);
+      if (i < width) chars[i] = ch;
+    }
+  } else {
+    std::copy(input, input + std::min(count, width), chars);
+  }
+
+  if (count >= width) return;
+
+  std::fill(chars + count, chars + width, fill_char);
+  if (attr) std::fill(attr + count, attr + width, fill_attr);
+}
+
+// Returns how many of the line feeds starting at `begin' can be applied as a
+// single scroll, at most `limit'.  Only line feeds preceded by complete lines
+// of characters DecodeUTF8 accepts are counted, and the text may not wrap
+// when written from column `x' of a `width' column screen, so ProcessText is
+// guaranteed to reach each counted line feed without scrolling in between.
+size_t CountLineFeeds(const unsigned char* begin, const unsigned char* end,
+                      size_t x, size_t width, size_t limit) {
+  size_t count = 0;
+  Terminal::Cell cell;
+
+  while (begin != end && count < limit) {
+    if (*begin == '\n') {
+      ++count;
+      ++begin;
+    } else if (*begin == '\r') {
+      x = 0;
+      ++begin;
+    } else if (x == width) {
+      break;
+    } else if (*begin >= ' ' && *begin <= '~') {
+      ++x;
+      ++begin;
+    } else if (DecodeUTF8(&begin, end, &cell, 1, 0)) {
+      ++x;
+    } else {
+      break;
+    }
+  }
+
+  return count;
+}
+
 const struct {
   int index;
   uint16_t and_mask;
@@ -88,15 +430,156 @@ static const Terminal::Color kDefaultColors[256] = {
     0x8a8a8a, 0x949494, 0x9e9e9e, 0xa8a8a8, 0xb2b2b2, 0xbcbcbc, 0xc6c6c6,
     0xd0d0d0, 0xdadada, 0xe4e4e4, 0xeeeeee};
 
+// States of the escape sequence parser, following the DEC/ANSI parser state
+// diagram at https://vt100.net/emu/dec_ansi_parser.  DCS, SOS, PM and APC
+// strings share a single state, since their contents are ignored.
+enum ParserState : uint8_t {
+  kStateGround,
+  kStateEscape,
+  kStateEscapeIntermediate,
+  kStateCsiEntry,
+  kStateCsiParam,
+  kStateCsiIntermediate,
+  kStateCsiIgnore,
+  kStateOscString,
+  kStateIgnoreString,
+  kStateCount
+};
+
+enum ParserAction : uint8_t {
+  kActionNone,
+  kActionPrint,
+  kActionExecute,
+  kActionClear,
+  kActionCollect,
+  kActionParam,
+  kActionEscDispatch,
+  kActionCsiDispatch,
+};
+
+const int kMaxParamValue = 65535;
+
+// Each entry holds the action in the high nibble and the next state in the
+// low nibble.
+struct ParserTable {
+  uint8_t transitions[kStateCount][256];
+};
+
+constexpr void SetTransition(ParserTable& table, unsigned int state,
+                             unsigned int first, unsigned int last,
+                             ParserAction action, unsigned int next_state) {
+  for (unsigned int ch = first; ch <= last; ++ch)
+    table.transitions[state][ch] = (action << 4) | next_state;
+}
+
+// Executes C0 control characters other than CAN, SUB and ESC without
+// leaving `state`.
+constexpr void SetExecute(ParserTable& table, unsigned int state) {
+  SetTransition(table, state, 0x00, 0x17, kActionExecute, state);
+  SetTransition(table, state, 0x19, 0x19, kActionExecute, state);
+  SetTransition(table, state, 0x1c, 0x1f, kActionExecute, state);
+}
+
+constexpr ParserTable MakeParserTable() {
+  ParserTable table{};
+
+  for (unsigned int state = 0; state < kStateCount; ++state)
+    SetTransition(table, state, 0x00, 0xff, kActionNone, state);
+
+  // Bytes 0x80 and above are UTF-8, not 8-bit C1 controls.  They are printed
+  // in the ground state, part of the string in OSC strings, and cancel any
+  // other escape sequence.
+  SetExecute(table, kStateGround);
+  SetTransition(table, kStateGround, 0x20, 0x7e, kActionPrint, kStateGround);
+  SetTransition(table, kStateGround, 0x7f, 0x7f, kActionExecute, kStateGround);
+  SetTransition(table, kStateGround, 0x80, 0xff, kActionPrint, kStateGround);
+
+  SetExecute(table, kStateEscape);
+  SetTransition(table, kStateEscape, 0x20, 0x2f, kActionCollect,
+                kStateEscapeIntermediate);
+  SetTransition(table, kStateEscape, 0x30, 0x7e, kActionEscDispatch,
+                kStateGround);
+  SetTransition(table, kStateEscape, 'P', 'P', kActionNone,
+                kStateIgnoreString);
+  SetTransition(table, kStateEscape, 'X', 'X', kActionNone,
+                kStateIgnoreString);
+  SetTransition(table, kStateEscape, '[', '[', kActionClear, kStateCsiEntry);
+  SetTransition(table, kStateEscape, ']', ']', kActionNone, kStateOscString);
+  SetTransition(table, kStateEscape, '^', '_', kActionNone,
+                kStateIgnoreString);
+  SetTransition(table, kStateEscape, 0x80, 0xff, kActionNone, kStateGround);
+
+  SetExecute(table, kStateEscapeIntermediate);
+  SetTransition(table, kStateEscapeIntermediate, 0x20, 0x2f, kActionCollect,
+                kStateEscapeIntermediate);
+  SetTransition(table, kStateEscapeIntermediate, 0x30, 0x7e,
+                kActionEscDispatch, kStateGround);
+  SetTransition(table, kStateEscapeIntermediate, 0x80, 0xff, kActionNone,
+                kStateGround);
+
+  SetExecute(table, kStateCsiEntry);
+  SetTransition(table, kStateCsiEntry, 0x20, 0x2f, kActionCollect,
+                kStateCsiIntermediate);
+  SetTransition(table, kStateCsiEntry, '0', '9', kActionParam, kStateCsiParam);
+  SetTransition(table, kStateCsiEntry, ':', ':', kActionNone, kStateCsiIgnore);
+  SetTransition(table, kStateCsiEntry, ';', ';', kActionParam, kStateCsiParam);
+  SetTransition(table, kStateCsiEntry, 0x3c, 0x3f, kActionCollect,
+                kStateCsiParam);
+  SetTransition(table, kStateCsiEntry, 0x40, 0x7e, kActionCsiDispatch,
+                kStateGround);
+  SetTransition(table, kStateCsiEntry, 0x80, 0xff, kActionNone, kStateGround);
+
+  SetExecute(table, kStateCsiParam);
+  SetTransition(table, kStateCsiParam, 0x20, 0x2f, kActionCollect,
+                kStateCsiIntermediate);
+  SetTransition(table, kStateCsiParam, '0', '9', kActionParam, kStateCsiParam);
+  SetTransition(table, kStateCsiParam, ':', ':', kActionNone, kStateCsiIgnore);
+  SetTransition(table, kStateCsiParam, ';', ';', kActionParam, kStateCsiParam);
+  SetTransition(table, kStateCsiParam, 0x3c, 0x3f, kActionNone,
+                kStateCsiIgnore);
+  SetTransition(table, kStateCsiParam, 0x40, 0x7e, kActionCsiDispatch,
+                kStateGround);
+  SetTransition(table, kStateCsiParam, 0x80, 0xff, kActionNone, kStateGround);
+
+  SetExecute(table, kStateCsiIntermediate);
+  SetTransition(table, kStateCsiIntermediate, 0x20, 0x2f, kActionCollect,
+                kStateCsiIntermediate);
+  SetTransition(table, kStateCsiIntermediate, 0x30, 0x3f, kActionNone,
+                kStateCsiIgnore);
+  SetTransition(table, kStateCsiIntermediate, 0x40, 0x7e, kActionCsiDispatch,
+                kStateGround);
+  SetTransition(table, kStateCsiIntermediate, 0x80, 0xff, kActionNone,
+                kStateGround);
+
+  SetExecute(table, kStateCsiIgnore);
+  SetTransition(table, kStateCsiIgnore, 0x40, 0x7e, kActionNone, kStateGround);
+  SetTransition(table, kStateCsiIgnore, 0x80, 0xff, kActionNone, kStateGround);
+
+  // The text of OSC strings is currently ignored.  xterm accepts BEL as well
+  // as ST as the terminator.
+  SetTransition(table, kStateOscString, 0x07, 0x07, kActionNone, kStateGround);
+
+  // Transitions from anywhere.
+  for (unsigned int state = 0; state < kStateCount; ++state) {
+    SetTransition(table, state, 0x18, 0x18, kActionExecute, kStateGround);
+    SetTransition(table, state, 0x1a, 0x1a, kActionExecute, kStateGround);
+    SetTransition(table, state, 0x1b, 0x1b, kActionClear, kStateEscape);
+  }
+
+  return table;
+}
+
+constexpr ParserTable kParserTable = MakeParserTable();
+
 }  // namespace
 
+const uint32_t Terminal::kColdLine;
+
 Terminal::Terminal(std::function<void(const void*, size_t)>&& write_function)
     : reverse(),
       history_size(),
       scrolltop(),
       scrollbottom(),
-      escape(),
-      param(),
       appcursor(),
       hide_cursor(),
       insertmode(),
@@ -105,9 +588,22 @@ Terminal::Terminal(std::function<void(const void*, size_t)>&& write_function)
       focused(),
       history_scroll(),
       write_function_(std::move(write_function)),
+      parser_state_(kStateGround),
+      param_count_(),
+      private_marker_(),
+      intermediate_(),
       nch_(),
       savedx_(),
-      savedy_() {}
+      savedy_(),
+      attrs_(1, kDefaultAttr),
+      attrs_limit_(kMinAttrsLimit),
+      last_attr_key_(AttrKey(kDefaultAttr)),
+      last_attr_index_(),
+      cold_chars_screen_(),
+      cold_chars_line_(),
+      file_chars_index_(-1) {
+  attr_indexes_[last_attr_key_] = 0;
+}
 
 void Terminal::Init(unsigned int width, unsigned int height,
                     unsigned int space_width, unsigned int line_height,
@@ -124,16 +620,17 @@ void Terminal::Init(unsigned int width, unsigned int height,
 
   history_size = size_.ws_row + scroll_extra;
 
-  for (size_t i = 0; i < 2; ++i) {
-    size_t n = size_.ws_col * history_size;
-    screens_[i].chars.reset(new CharacterType[n]);
-    screens_[i].attr .reset(new Attr[n]);
+  // Blank cells are all zero bytes, so attribute 0 is the one the screens
+  // start out with.
+  attrs_.assign(1, EffectiveAttribute());
+  attr_indexes_.clear();
+  last_attr_key_ = AttrKey(attrs_[0]);
+  last_attr_index_ = 0;
+  attr_indexes_[last_attr_key_] = 0;
 
-    std::fill(&screens_[i].chars[0],
-              &screens_[i].chars[n], L' ');
-    std::fill(&screens_[i].attr[0],
-              &screens_[i].attr[n], EffectiveAttribute());
-  }
+  ResetScreen(&screens_[0], history_size, Cell{0, 0});
+  ResetScreen(&screens_[1], size_.ws_row, Cell{0, 0});
+  row_generations_.assign(size_.ws_row, 0);
 
   scrollbottom = size_.ws_row;
 
@@ -144,14 +641,22 @@ void Terminal::Resize(unsigned int width, unsigned int height,
                       unsigned int space_width, unsigned int line_height) {
   if (width == size_.ws_xpixel && height == size_.ws_ypixel) return;
 
-  NormalizeHistoryBuffer();
-
   int cols = std::max(width / space_width, 1U);
   int rows = std::max(height / line_height, 1U);
 
   int oldcols = size_.ws_col;
   int oldrows = size_.ws_row;
 
+  if ((cols != oldcols || rows != oldrows) && history_file_.IsOpen()) {
+    // The history is discarded below, so keep it in the history file, along
+    // with the rows that no longer fit above the cursor.
+    size_t dropped_rows = 0;
+    if (rows < oldrows && screens_[0].cursor_y >= rows)
+      dropped_rows = screens_[0].cursor_y - rows + 1;
+    SpillHistory(dropped_rows);
+    file_chars_index_ = -1;
+  }
+
   size_.ws_xpixel = width;
   size_.ws_ypixel = height;
   size_.ws_col = cols;
@@ -159,18 +664,29 @@ void Terminal::Resize(unsigned int width, unsigned int height,
   history_size += rows - oldrows;
 
   if (cols != oldcols || rows != oldrows) {
-    for (size_t i = 0; i < 2; ++i) {
-      std::unique_ptr<wchar_t[]> oldchars = std::move(screens_[i].chars);
-      std::unique_ptr<Attr[]> oldattr = std::move(screens_[i].attr);
+    // Interned up front, since the screens have different sizes while they
+    // are being reallocated.
+    const Cell blank{0, InternAttr(EffectiveAttribute())};
 
-      size_t n = size_.ws_col * history_size;
-      screens_[i].chars.reset(new wchar_t[n]);
-      screens_[i].attr .reset(new Attr[n]);
+    for (size_t i = 0; i < 2; ++i) {
+      auto oldlines = std::move(screens_[i].lines);
+      auto oldcells = std::move(screens_[i].cells);
+      size_t old_scroll_line = screens_[i].scroll_line;
+      size_t old_line_count = screens_[i].line_count;
 
-      std::fill(&screens_[i].chars[0],
-                &screens_[i].chars[n], L' ');
-      std::fill(&screens_[i].attr[0],
-                &screens_[i].attr[n], EffectiveAttribute());
+      if (i) {
+        ResetScreen(&screens_[i], rows, blank);
+      } else {
+        // The history keeps the all-zero blank, so that it stays in shared
+        // zero pages, and only the rows get the current attribute.
+        ResetScreen(&screens_[i], history_size, Cell{0, 0});
+        if (blank.attr) {
+          for (int row = 0; row < rows; ++row) {
+            Cell* cells = &screens_[i].cells[screens_[i].lines[row] * cols];
+            std::fill(cells, cells + cols, blank);
+          }
+        }
+      }
 
       scrollbottom = rows;
 
@@ -181,854 +697,906 @@ void Terminal::Resize(unsigned int width, unsigned int height,
         minrows = oldrows;
       } else {
         if (screens_[i].cursor_y >= rows)
-          srcoff = current_screen_->cursor_y - rows + 1;
+          srcoff = screens_[i].cursor_y - rows + 1;
         minrows = rows;
       }
 
       int mincols = (cols < oldcols) ? cols : oldcols;
 
       for (int row = 0; row < minrows; ++row) {
-        memcpy(&screens_[i].chars[row * cols],
-               &oldchars[(row + srcoff) * oldcols],
-               mincols * sizeof(CharacterType));
-        memcpy(&screens_[i].attr[row * cols],
-               &oldattr[(row + srcoff) * oldcols], mincols * sizeof(Attr));
+        size_t oldrow =
+            oldlines[(old_scroll_line + row + srcoff) % old_line_count];
+        memcpy(&screens_[i].cells[screens_[i].lines[row] * cols],
+               &oldcells[oldrow * oldcols], mincols * sizeof(Cell));
       }
 
       screens_[i].cursor_y -= srcoff;
 
       screens_[i].cursor_x =
-          std::max(std::min(screens_[i].cursor_x, rows - 1), 0);
+          std::max(std::min(screens_[i].cursor_x, cols - 1), 0);
       screens_[i].cursor_y =
-          std::max(std::min(screens_[i].cursor_y, cols - 1), 0);
+          std::max(std::min(screens_[i].cursor_y, rows - 1), 0);
     }
+
+    row_generations_.resize(rows);
+    DamageRows(0, rows);
   }
 }
 
-void Terminal::ProcessData(const void* buf, size_t count) {
-  const unsigned char* begin = reinterpret_cast<const unsigned char*>(buf);
-  const unsigned char* end = begin + count;
-
-  // Redundant, optimized character processing code for the typical case.
-  if (!escape && !insertmode && !nch_ && !current_screen_->use_alt_charset) {
-    Attr attr = EffectiveAttribute();
-    size_t offset = (current_screen_->scroll_line + current_screen_->cursor_y) %
-                        history_size * size_.ws_col +
-                    current_screen_->cursor_x;
-
-    for (; begin != end; ++begin) {
-      if (*begin >= ' ' && *begin <= '~') {
-        if (current_screen_->cursor_x == size_.ws_col) {
-          if (++current_screen_->cursor_y >= size_.ws_row) {
-            Scroll(false);
-            --current_screen_->cursor_y;
-          }
-
-          current_screen_->cursor_x = 0;
-
-          offset = (current_screen_->scroll_line + current_screen_->cursor_y) %
-                   history_size * size_.ws_col;
-        }
+const unsigned char* Terminal::ProcessText(const unsigned char* begin,
+                                             const unsigned char* end) {
+  uint32_t attr = InternAttr(EffectiveAttribute());
+  Cell* cells = LineCells(RowLine(current_screen_->cursor_y));
 
-        current_screen_->chars[offset] = *begin;
-        current_screen_->attr[offset] = attr;
-        ++current_screen_->cursor_x;
-        ++offset;
-      } else if (*begin == '\r') {
-        current_screen_->cursor_x = 0;
-        offset = (current_screen_->scroll_line + current_screen_->cursor_y) %
-                 history_size * size_.ws_col;
-      } else if (*begin == '\n') {
-        ++current_screen_->cursor_y;
+  // Line feeds that were already scrolled for by an earlier batched scroll.
+  size_t pending_line_feeds = 0;
 
-        if (current_screen_->cursor_y == scrollbottom ||
-            current_screen_->cursor_y >= size_.ws_row) {
+  while (begin != end) {
+    if ((*begin >= ' ' && *begin <= '~') || *begin >= 0x80) {
+      if (current_screen_->cursor_x == size_.ws_col) {
+        if (++current_screen_->cursor_y >= size_.ws_row) {
           Scroll(false);
           --current_screen_->cursor_y;
         }
 
-        offset = (current_screen_->scroll_line + current_screen_->cursor_y) %
-                     history_size * size_.ws_col +
-                 current_screen_->cursor_x;
-      } else {
-        break;
+        current_screen_->cursor_x = 0;
+        cells = LineCells(RowLine(current_screen_->cursor_y));
       }
-    }
-  }
 
-  for (; begin != end; ++begin) {
-    switch (escape) {
-      case 0:
+      // Write the whole run up to the end of the line at once.
+      size_t length =
+          DecodeUTF8(&begin, end, &cells[current_screen_->cursor_x],
+                     size_.ws_col - current_screen_->cursor_x, attr);
+      if (!length) break;
+
+      DamageRow(current_screen_->cursor_y);
+      current_screen_->cursor_x += length;
+    } else if (*begin == '\r') {
+      current_screen_->cursor_x = 0;
+      ++begin;
+    } else if (*begin == '\n') {
+      ++current_screen_->cursor_y;
+
+      if (pending_line_feeds) {
+        --pending_line_feeds;
+      } else if (current_screen_->cursor_y == scrollbottom &&
+                 (scrolltop || scrollbottom != size_.ws_row)) {
+        // Scrolling a region moves all of its lines, so scroll once for this
+        // and the following lines, and then write them into the rows they
+        // would have ended up in.
+        size_t count =
+            1 + CountLineFeeds(begin + 1, end, current_screen_->cursor_x,
+                               size_.ws_col, scrollbottom - scrolltop - 1);
+        Scroll(false, count);
+        current_screen_->cursor_y -= count;
+        pending_line_feeds = count - 1;
+      } else if (current_screen_->cursor_y == scrollbottom ||
+                 current_screen_->cursor_y >= size_.ws_row) {
+        Scroll(false);
+        --current_screen_->cursor_y;
+      }
 
-        switch (*begin) {
-          case '\033':
+      cells = LineCells(RowLine(current_screen_->cursor_y));
+      ++begin;
+    } else {
+      break;
+    }
+  }
 
-            escape = 1;
-            memset(param, 0, sizeof(param));
+  return begin;
+}
 
-            break;
+void Terminal::ProcessData(const void* buf, size_t count) {
+  const unsigned char* begin = reinterpret_cast<const unsigned char*>(buf);
+  const unsigned char* end = begin + count;
 
-          case '\\':
+  while (begin != end) {
+    // Redundant, optimized character processing code for the typical case.
+    if (parser_state_ == kStateGround && !insertmode && !nch_ &&
+        !current_screen_->use_alt_charset)
+      begin = ProcessText(begin, end);
 
-            escape = 0;
+    begin = ProcessEscapes(begin, end);
+  }
+}
 
-            break;
+const unsigned char* Terminal::ProcessEscapes(const unsigned char* begin,
+                                              const unsigned char* end) {
+  for (; begin != end; ++begin) {
+    const uint8_t transition = kParserTable.transitions[parser_state_][*begin];
+    parser_state_ = transition & 0x0f;
 
-          case '\b':
+    switch (transition >> 4) {
+      case kActionNone:
+        break;
 
-            if (current_screen_->cursor_x > 0) --current_screen_->cursor_x;
+      case kActionPrint:
+        Print(*begin);
+        break;
 
-            break;
+      case kActionExecute:
+        Execute(*begin);
+        break;
 
-          case '\t': {
-            unsigned int next_tab = (current_screen_->cursor_x + 8) & ~7;
-            auto tab_stop =
-                tab_stops_.lower_bound(current_screen_->cursor_x + 1);
+      case kActionClear:
+        // An escape sequence also ends any partial UTF-8 sequence.
+        nch_ = 0;
+        memset(params_, 0, sizeof(params_));
+        param_count_ = 1;
+        private_marker_ = 0;
+        intermediate_ = 0;
+        break;
 
-            if (tab_stop != tab_stops_.end() && *tab_stop < next_tab)
-              current_screen_->cursor_x = *tab_stop;
-            else
-              current_screen_->cursor_x = next_tab;
+      case kActionCollect:
+        if (*begin < 0x30)
+          intermediate_ = *begin;
+        else
+          private_marker_ = *begin;
+        break;
 
-            if (current_screen_->cursor_x >= size_.ws_col)
-              current_screen_->cursor_x = size_.ws_col - 1;
-          } break;
+      case kActionParam:
+        if (*begin == ';') {
+          // Excess parameters overwrite the last one.
+          if (param_count_ < kMaxParams) ++param_count_;
+          params_[param_count_ - 1] = 0;
+        } else {
+          int& param = params_[param_count_ - 1];
+          param = std::min(param * 10 + (*begin - '0'), kMaxParamValue);
+        }
+        break;
 
-          case '\n':
+      case kActionEscDispatch:
+        EscDispatch(*begin);
+        break;
 
-            ++current_screen_->cursor_y;
+      case kActionCsiDispatch:
+        CsiDispatch(*begin);
+        break;
+    }
 
-            if (current_screen_->cursor_y == scrollbottom ||
-                current_screen_->cursor_y >= size_.ws_row) {
-              Scroll(false);
-              --current_screen_->cursor_y;
-            }
+    // Return to the fast path as soon as it can handle the input again.
+    if (parser_state_ == kStateGround && !nch_) return begin + 1;
+  }
 
-            break;
+  return begin;
+}
 
-          case '\r':
+void Terminal::Print(unsigned char ch) {
+  assert(current_screen_->cursor_x >= 0 &&
+         current_screen_->cursor_x <= size_.ws_col);
+  assert(current_screen_->cursor_y >= 0 &&
+         current_screen_->cursor_y < size_.ws_row);
 
-            current_screen_->cursor_x = 0;
+  if (current_screen_->cursor_x == size_.ws_col) {
+    ++current_screen_->cursor_y;
+    current_screen_->cursor_x = 0;
+  }
 
-            break;
+  // TODO(mortehu): Check if we need to test against scrollbottom as
+  // well.
+  if (current_screen_->cursor_y >= size_.ws_row) {
+    Scroll(false);
+    --current_screen_->cursor_y;
+  }
 
-          case '\177':
+  if (nch_) {
+    if ((ch & 0xC0) != 0x80) {
+      nch_ = 0;
+      AddChar(ch);
+    } else {
+      ch_ <<= 6;
+      ch_ |= ch & 0x3F;
 
-            if (current_screen_->cursor_y < size_.ws_row &&
-                current_screen_->cursor_x < size_.ws_col)
-              current_screen_->chars[(current_screen_->scroll_line +
-                                      current_screen_->cursor_y) %
-                                         history_size * size_.ws_col +
-                                     current_screen_->cursor_x] = 0;
+      if (0 == --nch_) {
+        AddChar(ch_);
+      }
+    }
+  } else {
+    if ((ch & 0x80) == 0) {
+      AddChar(ch);
+    } else if ((ch & 0xE0) == 0xC0) {
+      ch_ = ch & 0x1F;
+      nch_ = 1;
+    } else if ((ch & 0xF0) == 0xE0) {
+      ch_ = ch & 0x0F;
+      nch_ = 2;
+    } else if ((ch & 0xF8) == 0xF0) {
+      ch_ = ch & 0x03;
+      nch_ = 3;
+    } else if ((ch & 0xFC) == 0xF8) {
+      ch_ = ch & 0x01;
+      nch_ = 4;
+    }
+  }
+}
 
-            break;
+void Terminal::Execute(unsigned char ch) {
+  // A control character in the middle of a UTF-8 sequence ends it.
+  nch_ = 0;
 
-          case ('O' & 0x3F): /* ^O = default character set */
+  switch (ch) {
+    case '\b':
 
-            break;
+      if (current_screen_->cursor_x > 0) --current_screen_->cursor_x;
 
-          case ('N' & 0x3F): /* ^N = alternate character set */
+      break;
 
-            break;
+    case '\t': {
+      unsigned int next_tab = (current_screen_->cursor_x + 8) & ~7;
+      auto tab_stop = tab_stops_.lower_bound(current_screen_->cursor_x + 1);
 
-          default:
+      if (tab_stop != tab_stops_.end() && *tab_stop < next_tab)
+        current_screen_->cursor_x = *tab_stop;
+      else
+        current_screen_->cursor_x = next_tab;
 
-            assert(current_screen_->cursor_x >= 0 &&
-                   current_screen_->cursor_x <= size_.ws_col);
-            assert(current_screen_->cursor_y >= 0 &&
-                   current_screen_->cursor_y < size_.ws_row);
+      if (current_screen_->cursor_x >= size_.ws_col)
+        current_screen_->cursor_x = size_.ws_col - 1;
+    } break;
 
-            if (current_screen_->cursor_x == size_.ws_col) {
-              ++current_screen_->cursor_y;
-              current_screen_->cursor_x = 0;
-            }
+    case '\n':
 
-            // TODO(mortehu): Check if we need to test against scrollbottom as
-            // well.
-            if (current_screen_->cursor_y >= size_.ws_row) {
-              Scroll(false);
-              --current_screen_->cursor_y;
-            }
+      ++current_screen_->cursor_y;
 
-            if (nch_) {
-              if ((*begin & 0xC0) != 0x80) {
-                nch_ = 0;
-                AddChar(*begin);
-              } else {
-                ch_ <<= 6;
-                ch_ |= *begin & 0x3F;
-
-                if (0 == --nch_) {
-                  AddChar(ch_);
-                }
-              }
-            } else {
-              if ((*begin & 0x80) == 0) {
-                AddChar(*begin);
-              } else if ((*begin & 0xE0) == 0xC0) {
-                ch_ = *begin & 0x1F;
-                nch_ = 1;
-              } else if ((*begin & 0xF0) == 0xE0) {
-                ch_ = *begin & 0x0F;
-                nch_ = 2;
-              } else if ((*begin & 0xF8) == 0xF0) {
-                ch_ = *begin & 0x03;
-                nch_ = 3;
-              } else if ((*begin & 0xFC) == 0xF8) {
-                ch_ = *begin & 0x01;
-                nch_ = 4;
-              }
-            }
-        }
+      if (current_screen_->cursor_y == scrollbottom ||
+          current_screen_->cursor_y >= size_.ws_row) {
+        Scroll(false);
+        --current_screen_->cursor_y;
+      }
 
-        break;
+      break;
 
-      case 1:
+    case '\r':
 
-        switch (*begin) {
-          case '\\':
+      current_screen_->cursor_x = 0;
 
-            escape = 0;
+      break;
 
-            break;
+    case '\177':
 
-          case '7':
+      if (current_screen_->cursor_y < size_.ws_row &&
+          current_screen_->cursor_x < size_.ws_col) {
+        LineCells(RowLine(current_screen_->cursor_y))
+            [current_screen_->cursor_x].ch = 0;
+        DamageRow(current_screen_->cursor_y);
+      }
 
-            escape = 0;
-            savedx_ = current_screen_->cursor_x;
-            savedy_ = current_screen_->cursor_y;
+      break;
 
-            break;
+    case ('O' & 0x3F): /* ^O = default character set */
 
-          case '8':
+      break;
 
-            escape = 0;
-            current_screen_->cursor_x = savedx_;
-            current_screen_->cursor_y = savedy_;
+    case ('N' & 0x3F): /* ^N = alternate character set */
 
-            break;
+      break;
+  }
+}
 
-          case 'D':
+void Terminal::EscDispatch(unsigned char final) {
+  switch (intermediate_) {
+    case 0:
+      break;
 
-            escape = 0;
-            ++current_screen_->cursor_y;
+    case '(':
+      // Designate the G0 character set.
+      switch (final) {
+        case '0':
+          current_screen_->use_alt_charset = true;
+          break;
+        case 'B':
+          current_screen_->use_alt_charset = false;
+          break;
+      }
+      return;
 
-            if (current_screen_->cursor_y == scrollbottom ||
-                current_screen_->cursor_y >= size_.ws_row) {
-              Scroll(false);
-              --current_screen_->cursor_y;
-            }
+    case '#':
+      // DEC screen alignment test.
+      if (final == '8') {
+        for (size_t i = 0; i < size_.ws_row; ++i)
+          ClearLineWithAttr(RowLine(i), 'E', kDefaultAttr);
+      }
+      return;
 
-            break;
+    default:
+      return;
+  }
 
-          case 'E':
+  switch (final) {
+    case '7':
 
-            escape = 0;
-            current_screen_->cursor_x = 0;
-            ++current_screen_->cursor_y;
+      savedx_ = current_screen_->cursor_x;
+      savedy_ = current_screen_->cursor_y;
 
-            if (current_screen_->cursor_y == scrollbottom ||
-                current_screen_->cursor_y >= size_.ws_row) {
-              Scroll(false);
-              --current_screen_->cursor_y;
-            }
+      break;
 
-            break;
+    case '8':
 
-          case 'H':
+      current_screen_->cursor_x = savedx_;
+      current_screen_->cursor_y = savedy_;
 
-            escape = 0;
-            tab_stops_.insert(current_screen_->cursor_x);
+      break;
 
-            break;
+    case 'D':
 
-          case 'c':
+      ++current_screen_->cursor_y;
 
-            escape = 0;
-            tab_stops_.clear();
-            current_screen_->cursor_x = 0;
-            current_screen_->cursor_y = 0;
-            for (size_t i = 0; i < size_.ws_row; ++i)
-              ClearLine((current_screen_->scroll_line +
-                         current_screen_->cursor_y + i) %
-                        history_size);
-            current_screen_->use_alt_charset = false;
+      if (current_screen_->cursor_y == scrollbottom ||
+          current_screen_->cursor_y >= size_.ws_row) {
+        Scroll(false);
+        --current_screen_->cursor_y;
+      }
 
-            break;
+      break;
 
-          case '[':
+    case 'E':
 
-            escape = 2;
-            memset(param, 0, sizeof(param));
+      current_screen_->cursor_x = 0;
+      ++current_screen_->cursor_y;
 
-            break;
+      if (current_screen_->cursor_y == scrollbottom ||
+          current_screen_->cursor_y >= size_.ws_row) {
+        Scroll(false);
+        --current_screen_->cursor_y;
+      }
 
-          case '%':
+      break;
 
-            escape = 2;
-            param[0] = -1;
+    case 'H':
 
-            break;
+      tab_stops_.insert(current_screen_->cursor_x);
 
-          case ']':
+      break;
 
-            escape = 2;
-            param[0] = -2;
+    case 'c':
 
-            break;
+      tab_stops_.clear();
+      synchronized_output = false;
+      current_screen_->cursor_x = 0;
+      current_screen_->cursor_y = 0;
+      for (size_t i = 0; i < size_.ws_row; ++i)
+        ClearLine(RowLine(current_screen_->cursor_y + i));
+      current_screen_->use_alt_charset = false;
 
-          case '(':
+      break;
 
-            escape = 2;
-            param[0] = -4;
+    case 'M':
 
-            break;
+      if (current_screen_->cursor_x == 0 &&
+          current_screen_->cursor_y == scrolltop)
+        ReverseScroll(false);
+      else if (current_screen_->cursor_y)
+        --current_screen_->cursor_y;
 
-          case '#':
+      break;
+  }
+}
 
-            escape = 2;
-            param[0] = -5;
+void Terminal::CsiDispatch(unsigned char final) {
+  // DECRQM, asking whether a DEC private mode is set, is the only supported
+  // control sequence with intermediate bytes.
+  if (intermediate_) {
+    if (private_marker_ == '?' && intermediate_ == '$' && final == 'p')
+      ReportDECMode(params_[0]);
+    return;
+  }
 
-            break;
+  switch (private_marker_) {
+    case 0:
+      break;
 
-          case 'M':
+    case '?':
+      if (final == 'h' || final == 'l') SetDECModes(final == 'h');
+      return;
 
-            if (current_screen_->cursor_x == 0 &&
-                current_screen_->cursor_y == scrolltop)
-              ReverseScroll(false);
-            else if (current_screen_->cursor_y)
-              --current_screen_->cursor_y;
+    default:
+      return;
+  }
 
-            escape = 0;
+  switch (final) {
+    case '@':
 
-            break;
+      if (!params_[0]) params_[0] = 1;
 
-          default:
+      InsertChars(params_[0]);
 
-            escape = 0;
-        }
+      break;
 
-        break;
+    case 'A':
 
-      default:
+      if (!params_[0]) params_[0] = 1;
 
-        if (*begin == '\\') {
-          escape = 0;
-        } else if (param[0] == -1) {
-          escape = 0;
-        } else if (param[0] == -2) {
-          /* Handle ESC ] Ps ; Pt BEL */
+      current_screen_->cursor_y -=
+          (params_[0] < current_screen_->cursor_y)
+              ? params_[0]
+              : current_screen_->cursor_y;
 
-          if (*begin == '\007') {
-            escape = 0;
-            break;
-          }
+      break;
 
-          if (escape == 2) {
-            if (*begin >= '0' && *begin <= '9') {
-              param[1] *= 10;
-              param[1] += *begin - '0';
-            } else if (*begin == ';') {
-              ++escape;
-            }
-          } else {
-            /* XXX: Store text */
-          }
-        } else if (param[0] == -4) {
-          switch (*begin) {
-            case '0':
-              current_screen_->use_alt_charset = true;
-              break;
-            case 'B':
-              current_screen_->use_alt_charset = false;
-              break;
-          }
+    case 'B':
 
-          escape = 0;
-        } else if (param[0] == -5) {
-          escape = 0;
-          switch (*begin) {
-            case '8':
-              for (size_t i = 0; i < size_.ws_row; ++i)
-                ClearLineWithAttr(
-                    (current_screen_->scroll_line + i) % history_size, 'E',
-                    kDefaultAttr);
-              break;
-          }
-        } else if (escape == 2 && *begin == '?') {
-          param[0] = -3;
-          ++escape;
-        } else if (escape == 2 && *begin == '>') {
-          param[0] = -4;
-          ++escape;
-        } else if (*begin == ';') {
-          if (escape < (int)sizeof(param) + 1)
-            param[++escape - 2] = 0;
-          else
-            param[(sizeof(param) / sizeof(param[0])) - 1] = 0;
-        } else if (*begin >= '0' && *begin <= '9') {
-          param[escape - 2] *= 10;
-          param[escape - 2] += *begin - '0';
-        } else if (param[0] == -3) {
-          if (*begin == 'h') {
-            for (int k = 1; k < escape - 1; ++k) {
-              switch (param[k]) {
-                case 1:
-                  appcursor = true;
-                  break;
-                case 25:
-                  hide_cursor = false;
-                  break;
-                case 1049:
-                  if (current_screen_ != &screens_[1]) {
-                    std::fill(&screens_[1].chars[0],
-                              &screens_[1].chars[size_.ws_col * history_size],
-                              0);
-                    std::fill(&screens_[1].attr[0],
-                              &screens_[1].attr[size_.ws_col * history_size],
-                              kDefaultAttr);
-                    SetScreen(1);
-                  }
-                  break;
-                case 2004:
-                  bracketed_paste = true;
-                  break;
-              }
-            }
-          } else if (*begin == 'l') {
-            for (int k = 1; k < escape - 1; ++k) {
-              switch (param[k]) {
-                case 1:
-                  appcursor = false;
-                  break;
-                case 25:
-                  hide_cursor = true;
-                  break;
-                case 1049:
-                  SetScreen(0);
-                  break;
-                case 2004:
-                  bracketed_paste = false;
-                  break;
-              }
-            }
-          }
+      if (!params_[0]) params_[0] = 1;
 
-          escape = 0;
-        } else {
-          switch (*begin) {
-            case '@':
+      current_screen_->cursor_y =
+          (params_[0] + current_screen_->cursor_y < size_.ws_row)
+              ? (params_[0] + current_screen_->cursor_y)
+              : (size_.ws_row - 1);
 
-              if (!param[0]) param[0] = 1;
+      break;
 
-              InsertChars(param[0]);
+    case 'C':
 
-              break;
+      if (!params_[0]) params_[0] = 1;
 
-            case 'A':
+      current_screen_->cursor_x =
+          (params_[0] + current_screen_->cursor_x < size_.ws_col)
+              ? (params_[0] + current_screen_->cursor_x)
+              : (size_.ws_col - 1);
 
-              if (!param[0]) param[0] = 1;
+      break;
 
-              current_screen_->cursor_y -=
-                  (param[0] < current_screen_->cursor_y)
-                      ? param[0]
-                      : current_screen_->cursor_y;
+    case 'D':
 
-              break;
+      if (!params_[0]) params_[0] = 1;
 
-            case 'B':
+      current_screen_->cursor_x -=
+          (params_[0] < current_screen_->cursor_x)
+              ? params_[0]
+              : current_screen_->cursor_x;
 
-              if (!param[0]) param[0] = 1;
+      break;
 
-              current_screen_->cursor_y =
-                  (param[0] + current_screen_->cursor_y < size_.ws_row)
-                      ? (param[0] + current_screen_->cursor_y)
-                      : (size_.ws_row - 1);
+    case 'E':
 
-              break;
+      current_screen_->cursor_x = 0;
+      ++current_screen_->cursor_y;
 
-            case 'C':
+      if (current_screen_->cursor_y == scrollbottom ||
+          current_screen_->cursor_y >= size_.ws_row) {
+        Scroll(false);
+        --current_screen_->cursor_y;
+      }
 
-              if (!param[0]) param[0] = 1;
+      break;
 
-              current_screen_->cursor_x =
-                  (param[0] + current_screen_->cursor_x < size_.ws_col)
-                      ? (param[0] + current_screen_->cursor_x)
-                      : (size_.ws_col - 1);
+    case 'F':
 
-              break;
+      current_screen_->cursor_x = 0;
 
-            case 'D':
+      if (current_screen_->cursor_y == scrolltop)
+        ReverseScroll(false);
+      else if (current_screen_->cursor_y)
+        --current_screen_->cursor_y;
 
-              if (!param[0]) param[0] = 1;
+      break;
 
-              current_screen_->cursor_x -=
-                  (param[0] < current_screen_->cursor_x)
-                      ? param[0]
-                      : current_screen_->cursor_x;
+    case 'G':
 
-              break;
+      if (params_[0] > 0) --params_[0];
 
-            case 'E':
+      current_screen_->cursor_x =
+          (params_[0] < size_.ws_col) ? params_[0] : (size_.ws_col - 1);
 
-              current_screen_->cursor_x = 0;
-              ++current_screen_->cursor_y;
+      break;
 
-              if (current_screen_->cursor_y == scrollbottom ||
-                  current_screen_->cursor_y >= size_.ws_row) {
-                Scroll(false);
-                --current_screen_->cursor_y;
-              }
+    case 'H':
+    case 'f':
 
-              break;
+      if (params_[0] > 0) --params_[0];
 
-            case 'F':
+      if (params_[1] > 0) --params_[1];
 
-              current_screen_->cursor_x = 0;
+      current_screen_->cursor_y =
+          (params_[0] < size_.ws_row) ? params_[0] : (size_.ws_row - 1);
+      current_screen_->cursor_x =
+          (params_[1] < size_.ws_col) ? params_[1] : (size_.ws_col - 1);
 
-              if (current_screen_->cursor_y == scrolltop)
-                ReverseScroll(false);
-              else if (current_screen_->cursor_y)
-                --current_screen_->cursor_y;
+      break;
 
-              escape = 0;
+    case 'J': {
+      size_t begin = current_screen_->scroll_line;
+      size_t end = current_screen_->scroll_line + size_.ws_row;
+      bool fall_through = true;
 
-              break;
+      switch (params_[0]) {
+        case 0:
+          begin = current_screen_->scroll_line +
+                  current_screen_->cursor_y + 1;
+          break;
+        case 1:
+          end =
+              current_screen_->scroll_line + current_screen_->cursor_y;
+          break;
+        default:
+        case 2:
+          fall_through = false;
+          break;
+      }
 
-            case 'G':
+      for (size_t i = begin; i < end; ++i)
+        ClearLine(i % current_screen_->line_count);
 
-              if (param[0] > 0) --param[0];
+      if (!fall_through) break;
+    }
 
-              current_screen_->cursor_x =
-                  (param[0] < size_.ws_col) ? param[0] : (size_.ws_col - 1);
+    case 'K': {
+      size_t line = RowLine(current_screen_->cursor_y);
+      size_t begin, end;
 
-              break;
+      switch (params_[0]) {
+        case 0:
+          /* Clear from cursor to end */
+          begin = current_screen_->cursor_x;
+          end = size_.ws_col;
+          break;
+        case 1:
+          /* Clear from start to cursor.  The cursor is past the last column
+           * while a wrap is pending. */
+          begin = 0;
+          end = std::min<size_t>(current_screen_->cursor_x + 1, size_.ws_col);
+          break;
+        default:
+        case 2:
+          /* Clear entire line */
+          begin = 0;
+          end = size_.ws_col;
+      }
 
-            case 'H':
-            case 'f':
+      std::fill(LineCells(line) + begin, LineCells(line) + end,
+                Cell{L' ', InternAttr(EffectiveAttribute())});
+      DamageRow(current_screen_->cursor_y);
+    } break;
 
-              if (param[0] > 0) --param[0];
+    case 'L':
 
-              if (param[1] > 0) --param[1];
+      if (!params_[0])
+        params_[0] = 1;
+      else if (params_[0] > size_.ws_row)
+        params_[0] = size_.ws_row;
 
-              current_screen_->cursor_y =
-                  (param[0] < size_.ws_row) ? param[0] : (size_.ws_row - 1);
-              current_screen_->cursor_x =
-                  (param[1] < size_.ws_col) ? param[1] : (size_.ws_col - 1);
+      ReverseScroll(true, params_[0]);
 
-              break;
+      break;
 
-            case 'J': {
-              size_t begin = current_screen_->scroll_line;
-              size_t end = current_screen_->scroll_line + size_.ws_row;
-              bool fall_through = true;
+    case 'M':
 
-              switch (param[0]) {
-                case 0:
-                  begin = current_screen_->scroll_line +
-                          current_screen_->cursor_y + 1;
-                  break;
-                case 1:
-                  end =
-                      current_screen_->scroll_line + current_screen_->cursor_y;
-                  break;
-                default:
-                case 2:
-                  fall_through = false;
-                  break;
-              }
+      if (!params_[0])
+        params_[0] = 1;
+      else if (params_[0] > size_.ws_row)
+        params_[0] = size_.ws_row;
 
-              for (size_t i = begin; i < end; ++i) ClearLine(i % history_size);
+      Scroll(true, params_[0]);
 
-              if (!fall_through) break;
-            }
+      break;
 
-            case 'K': {
-              size_t line_offset =
-                  (current_screen_->scroll_line + current_screen_->cursor_y) %
-                  history_size * size_.ws_col;
-              size_t begin, end;
-
-              switch (param[0]) {
-                case 0:
-                  /* Clear from cursor to end */
-                  begin = current_screen_->cursor_x;
-                  end = size_.ws_col;
-                  break;
-                case 1:
-                  /* Clear from start to cursor */
-                  begin = 0;
-                  end = current_screen_->cursor_x + 1;
-                  break;
-                default:
-                case 2:
-                  /* Clear entire line */
-                  begin = 0;
-                  end = size_.ws_col;
-              }
+    case 'P': {
+      /* Delete character at cursor */
+      if (!params_[0]) params_[0] = 1;
+      if (current_screen_->cursor_x + params_[0] > size_.ws_col)
+        params_[0] = size_.ws_col - current_screen_->cursor_x;
 
-              Attr attr = EffectiveAttribute();
+      DeleteChars(params_[0]);
+    } break;
 
-              for (size_t x = begin; x < end; ++x) {
-                current_screen_->chars[line_offset + x] = ' ';
-                current_screen_->attr[line_offset + x] = attr;
-              }
-            } break;
+    case 'S':
 
-            case 'L':
+      params_[0] = std::max(
+          1, std::min(static_cast<int>(size_.ws_row), params_[0]));
 
-              if (!param[0])
-                param[0] = 1;
-              else if (param[0] > size_.ws_row)
-                param[0] = size_.ws_row;
+      Scroll(false, params_[0]);
 
-              while (param[0]--) ReverseScroll(true);
+      break;
 
-              break;
+    case 'T':
 
-            case 'M':
+      params_[0] = std::max(
+          1, std::min(static_cast<int>(size_.ws_row), params_[0]));
 
-              if (!param[0])
-                param[0] = 1;
-              else if (param[0] > size_.ws_row)
-                param[0] = size_.ws_row;
+      ReverseScroll(false, params_[0]);
 
-              while (param[0]--) Scroll(true);
+      break;
 
-              break;
+    case 'X': {
+      if (params_[0] <= 0) params_[0] = 1;
 
-            case 'P': {
-              /* Delete character at cursor */
-              if (!param[0]) param[0] = 1;
-              if (current_screen_->cursor_x + param[0] > size_.ws_col)
-                param[0] = size_.ws_col - current_screen_->cursor_x;
+      Cell blank{0, InternAttr(EffectiveAttribute())};
 
-              DeleteChars(param[0]);
-            } break;
+      for (int k = current_screen_->cursor_x;
+           k < current_screen_->cursor_x + params_[0] && k < size_.ws_col;
+           ++k) {
+        LineCells(RowLine(current_screen_->cursor_y))[k] = blank;
+      }
 
-            case 'S':
+      DamageRow(current_screen_->cursor_y);
 
-              param[0] = std::max(
-                  1, std::min(static_cast<int>(size_.ws_row), param[0]));
+    } break;
 
-              while (param[0]--) Scroll(false);
+    case 'c':
+      if (!params_[0]) {
+        // Terminal attributes requested.
+        write_function_("\033[?1;0c", 7);
+      }
+      break;
 
-              break;
+    case 'd':
 
-            case 'T':
+      if (params_[0] > 0)
+        --params_[0];
+      else
+        params_[0] = 0;
 
-              param[0] = std::max(
-                  1, std::min(static_cast<int>(size_.ws_row), param[0]));
+      current_screen_->cursor_y =
+          (params_[0] < size_.ws_row) ? params_[0] : (size_.ws_row - 1);
 
-              while (param[0]--) ReverseScroll(false);
+      break;
 
-              break;
+    case 'h':
 
-            case 'X': {
-              if (param[0] <= 0) param[0] = 1;
+      for (size_t k = 0; k < param_count_; ++k) {
+        switch (params_[k]) {
+          case 4:
+            insertmode = true;
+            break;
+        }
+      }
 
-              Attr attr = EffectiveAttribute();
+      break;
 
-              for (int k = current_screen_->cursor_x;
-                   k < current_screen_->cursor_x + param[0] && k < size_.ws_col;
-                   ++k) {
-                current_screen_->chars[(current_screen_->cursor_y +
-                                        current_screen_->scroll_line) %
-                                           history_size * size_.ws_col +
-                                       k] = 0;
-                current_screen_->attr[(current_screen_->cursor_y +
-                                       current_screen_->scroll_line) %
-                                          history_size * size_.ws_col +
-                                      k] = attr;
-              }
+    case 'l':
 
-            } break;
+      for (size_t k = 0; k < param_count_; ++k) {
+        switch (params_[k]) {
+          case 4:
+            insertmode = false;
+            break;
+        }
+      }
 
-            case 'c':
-              if (!param[0]) {
-                // Terminal attributes requested.
-                write_function_("\033[?1;0c", 7);
-              }
-              break;
+      break;
 
-            case 'd':
+    case 'm': {
+      for (size_t k = 0; k < param_count_;) {
+        int code = params_[k++];
 
-              if (param[0] > 0)
-                --param[0];
-              else
-                param[0] = 0;
+        switch (code) {
+          case 7:
+            reverse = true;
+            break;
+          case 27:
+            reverse = false;
+            break;
 
-              current_screen_->cursor_y =
-                  (param[0] < size_.ws_row) ? param[0] : (size_.ws_row - 1);
+          case 38: {
+            // Extended foreground color codes.
+
+            if (k >= param_count_) break;
+
+            switch (params_[k++]) {
+              case 2:  // RGB
+                if (k + 2 >= param_count_) break;
+                attribute_.fg =
+                    Color(params_[k], params_[k + 1], params_[k + 2]);
+                k += 3;
+                break;
+              case 5:  // Indexed
+                if (k < param_count_ && params_[k] >= 0 && params_[k] <= 255)
+                  attribute_.fg = kDefaultColors[params_[k++]];
+                break;
+            }
 
-              break;
+          } break;
 
-            case 'h':
+          case 48: {
+            // Extended background color codes.
+
+            if (k >= param_count_) break;
+
+            switch (params_[k++]) {
+              case 2:  // RGB
+                if (k + 2 >= param_count_) break;
+                attribute_.bg =
+                    Color(params_[k], params_[k + 1], params_[k + 2]);
+                k += 3;
+                break;
+              case 5:  // Indexed
+                if (k < param_count_ && params_[k] >= 0 && params_[k] <= 255)
+                  attribute_.bg = kDefaultColors[params_[k++]];
+                break;
+            }
 
-              for (int k = 0; k < escape - 1; ++k) {
-                switch (param[k]) {
-                  case 4:
-                    insertmode = true;
-                    break;
-                }
-              }
+          } break;
 
-              break;
+          case 0:
+            reverse = false;
 
-            case 'l':
+          // Fall through.
 
-              for (int k = 0; k < escape - 1; ++k) {
-                switch (param[k]) {
-                  case 4:
-                    insertmode = false;
-                    break;
-                }
+          default: {
+            for (size_t l = 0;
+                 l < sizeof(kANSIHelper) / sizeof(kANSIHelper[0]);
+                 ++l) {
+              if (kANSIHelper[l].index == code) {
+                ansi_attribute_ &= kANSIHelper[l].and_mask;
+                ansi_attribute_ |= kANSIHelper[l].or_mask;
+                break;
               }
+            }
 
-              break;
-
-            case 'm': {
-              for (int k = 0; k + 1 < escape;) {
-                int code = param[k++];
-
-                switch (code) {
-                  case 7:
-                    reverse = true;
-                    break;
-                  case 27:
-                    reverse = false;
-                    break;
-
-                  case 38: {
-                    // Extended foreground color codes.
-
-                    if (k + 1 >= escape) break;
-
-                    switch (param[k++]) {
-                      case 2:  // RGB
-                        if (k + 3 >= escape) break;
-                        attribute_.fg =
-                            Color(param[k], param[k + 1], param[k + 2]);
-                        k += 3;
-                        break;
-                      case 5:  // Indexed
-                        if (param[k] >= 0 && param[k] <= 255)
-                          attribute_.fg = kDefaultColors[param[k++]];
-                        break;
-                    }
-
-                  } break;
-
-                  case 48: {
-                    // Extended background color codes.
-
-                    if (k + 1 >= escape) break;
-
-                    switch (param[k++]) {
-                      case 2:  // RGB
-                        if (k + 3 >= escape) break;
-                        attribute_.bg =
-                            Color(param[k], param[k + 1], param[k + 2]);
-                        k += 3;
-                        break;
-                      case 5:  // Indexed
-                        if (param[k] >= 0 && param[k] <= 255)
-                          attribute_.bg = kDefaultColors[param[k++]];
-                        break;
-                    }
-
-                  } break;
-
-                  case 0:
-                    reverse = false;
-
-                  // Fall through.
-
-                  default: {
-                    for (size_t l = 0;
-                         l < sizeof(kANSIHelper) / sizeof(kANSIHelper[0]);
-                         ++l) {
-                      if (kANSIHelper[l].index == code) {
-                        ansi_attribute_ &= kANSIHelper[l].and_mask;
-                        ansi_attribute_ |= kANSIHelper[l].or_mask;
-                        break;
-                      }
-                    }
-
-                    unsigned fg_color_index = (ansi_attribute_ >> 8) & 7;
-                    if (ansi_attribute_ &
-                        (ATTR_HIGHLIGHT | ATTR_STANDOUT | ATTR_BOLD))
-                      fg_color_index += 8;
-
-                    attribute_.fg = ansi_colors_[fg_color_index];
-                    attribute_.bg = ansi_colors_[(ansi_attribute_ >> 12) & 7];
-                    attribute_.extra =
-                        ansi_attribute_ & (ATTR_BLINK | ATTR_UNDERLINE);
-                  } break;
-                }
-              }
-            } break;
+            unsigned fg_color_index = (ansi_attribute_ >> 8) & 7;
+            if (ansi_attribute_ &
+                (ATTR_HIGHLIGHT | ATTR_STANDOUT | ATTR_BOLD))
+              fg_color_index += 8;
 
-            case 'r':
+            attribute_.fg = ansi_colors_[fg_color_index];
+            attribute_.bg = ansi_colors_[(ansi_attribute_ >> 12) & 7];
+            attribute_.extra =
+                ansi_attribute_ & (ATTR_BLINK | ATTR_UNDERLINE);
+          } break;
+        }
+      }
+    } break;
 
-              if (param[0] < param[1]) {
-                --param[0];
+    case 'r':
 
-                if (param[1] > size_.ws_row) param[1] = size_.ws_row;
+      if (params_[0] < params_[1]) {
+        --params_[0];
 
-                if (param[0] < 0) param[0] = 0;
+        if (params_[1] > size_.ws_row) params_[1] = size_.ws_row;
 
-                if (param[0] >= param[1]) break;
+        if (params_[0] < 0) params_[0] = 0;
 
-                scrolltop = param[0];
-                scrollbottom = param[1];
-              } else {
-                scrolltop = 0;
-                scrollbottom = size_.ws_row;
-              }
+        if (params_[0] >= params_[1]) break;
 
-              break;
+        scrolltop = params_[0];
+        scrollbottom = params_[1];
+      } else {
+        scrolltop = 0;
+        scrollbottom = size_.ws_row;
+      }
 
-            case 's':
+      break;
 
-              savedx_ = current_screen_->cursor_x;
-              savedy_ = current_screen_->cursor_y;
+    case 's':
 
-              break;
+      savedx_ = current_screen_->cursor_x;
+      savedy_ = current_screen_->cursor_y;
 
-            case 'u':
+      break;
 
-              current_screen_->cursor_x = savedx_;
-              current_screen_->cursor_y = savedy_;
+    case 'u':
 
-              break;
-          }
+      current_screen_->cursor_x = savedx_;
+      current_screen_->cursor_y = savedy_;
+
+      break;
+  }
+}
 
-          escape = 0;
+void Terminal::SetDECModes(bool enable) {
+  for (size_t k = 0; k < param_count_; ++k) {
+    switch (params_[k]) {
+      case 1:
+        appcursor = enable;
+        break;
+      case 25:
+        hide_cursor = !enable;
+        break;
+      case 1049:
+        if (!enable) {
+          SetScreen(0);
+        } else if (current_screen_ != &screens_[1]) {
+          // The alternate screen has no history to scroll back through.
+          ResetScreen(&screens_[1], size_.ws_row,
+                      Cell{0, InternAttr(kDefaultAttr)});
+          SetScreen(1);
+          history_scroll = 0;
         }
+        break;
+      case 2004:
+        bracketed_paste = enable;
+        break;
+      case 2026:
+        if (enable && !synchronized_output) ++synchronized_output_frames;
+        synchronized_output = enable;
+        break;
     }
   }
 }
 
+void Terminal::ReportDECMode(int mode) {
+  // 0 means the mode is not recognized, 1 that it is set, and 2 that it is
+  // reset.
+  int value;
+
+  switch (mode) {
+    case 1:
+      value = appcursor ? 1 : 2;
+      break;
+    case 25:
+      value = hide_cursor ? 2 : 1;
+      break;
+    case 1049:
+      value = (current_screen_ == &screens_[1]) ? 1 : 2;
+      break;
+    case 2004:
+      value = bracketed_paste ? 1 : 2;
+      break;
+    case 2026:
+      value = synchronized_output ? 1 : 2;
+      break;
+    default:
+      value = 0;
+  }
+
+  char buf[32];
+  int length = snprintf(buf, sizeof(buf), "\033[?%d;%d$y", mode, value);
+  write_function_(buf, length);
+}
+
 void Terminal::GetState(State* state) const {
   state->width = size_.ws_col;
   state->height = size_.ws_row;
   state->chars.resize(size_.ws_col * size_.ws_row);
   state->attr.resize(size_.ws_col * size_.ws_row);
 
-  for (size_t row = 0, offset = (history_size - history_scroll +
-                                 current_screen_->scroll_line) *
-                                size_.ws_col;
-       row < size_.ws_row; ++row, offset += size_.ws_col) {
-    offset %= history_size * size_.ws_col;
-    std::copy(&current_screen_->chars[offset],
-              &current_screen_->chars[offset + size_.ws_col],
-              &state->chars[row * size_.ws_col]);
-    std::copy(&current_screen_->attr[offset],
-              &current_screen_->attr[offset + size_.ws_col],
-              &state->attr[row * size_.ws_col]);
+  for (size_t row = 0; row < size_.ws_row; ++row) CopyRow(row, state);
+
+  CopyCursorAndSelection(state);
+}
+
+void Terminal::UpdateState(State* state) const {
+  const uint64_t shift = screen_scroll_count_ - state->scroll_count;
+
+  // Rows in the history are not tracked, so only a view of the screen itself
+  // can be updated.
+  if (state->width != size_.ws_col || state->height != size_.ws_row ||
+      state->history_scroll || history_scroll || shift >= size_.ws_row) {
+    GetState(state);
+    return;
   }
 
+  if (shift) {
+    const size_t cells = shift * size_.ws_col;
+    std::copy(state->chars.begin() + cells, state->chars.end(),
+              state->chars.begin());
+    std::copy(state->attr.begin() + cells, state->attr.end(),
+              state->attr.begin());
+  }
+
+  for (size_t row = 0; row < size_.ws_row; ++row) {
+    if (row_generations_[row] > state->generation) CopyRow(row, state);
+  }
+
+  CopyCursorAndSelection(state);
+}
+
+void Terminal::CopyRow(size_t row, State* state) const {
+  const size_t history_lines = HistoryLines();
+  size_t line = (history_lines - history_scroll + row) % history_lines;
+  CharacterType* chars = &state->chars[row * size_.ws_col];
+  Attr* attr = &state->attr[row * size_.ws_col];
+
+  if (MapRow(&line)) {
+    DecodeLine(history_file_.Line(line), chars, attr);
+    return;
+  }
+
+  if (current_screen_->lines[line] == kColdLine) {
+    DecodeLine(LineData(ColdLine(*current_screen_, line)), chars, attr);
+    return;
+  }
+
+  const Cell* cells = LineCells(line);
+
+  for (size_t x = 0; x < size_.ws_col; ++x) {
+    chars[x] = cells[x].ch;
+    attr[x] = attrs_[cells[x].attr];
+  }
+}
+
+void Terminal::CopyCursorAndSelection(State* state) const {
+  const size_t history_lines = HistoryLines();
+
   state->cursor_x = std::min(current_screen_->cursor_x, size_.ws_col - 1);
   state->cursor_y = current_screen_->cursor_y + history_scroll;
 
@@ -1041,58 +1609,56 @@ void Terminal::GetState(State* state) const {
     selend = select_begin;
   }
 
-  state->selection_begin = (selbegin + history_scroll * size_.ws_col) %
-                           (history_size * size_.ws_col);
+  const size_t scroll_offset = size_t{history_scroll} * size_.ws_col;
+  state->selection_begin =
+      (selbegin + scroll_offset) % (history_lines * size_.ws_col);
   state->selection_end =
-      (selend + history_scroll * size_.ws_col) % (history_size * size_.ws_col);
+      (selend + scroll_offset) % (history_lines * size_.ws_col);
 
   state->cursor_hidden = hide_cursor;
   state->focused = focused;
 
   if (!hide_cursor) state->cursor_hint = cursor_hint_;
+
+  state->generation = generation_;
+  state->scroll_count = screen_scroll_count_;
+  state->history_scroll = history_scroll;
+}
+
+void Terminal::GetDamagedRows(uint64_t since,
+                              std::vector<size_t>* rows) const {
+  rows->clear();
+
+  for (size_t row = 0; row < size_.ws_row; ++row) {
+    if (RowDamaged(row, since)) rows->push_back(row);
+  }
 }
 
 void Terminal::InsertChars(size_t count) {
-  size_t line_offset =
-      (current_screen_->scroll_line + current_screen_->cursor_y) %
-      history_size * size_.ws_col;
+  Cell* cells = LineCells(RowLine(current_screen_->cursor_y));
+  Cell blank{L' ', InternAttr(EffectiveAttribute())};
   size_t k = size_.ws_col;
 
   while (k > current_screen_->cursor_x + count) {
     --k;
-    current_screen_->chars[line_offset + k] =
-        current_screen_->chars[line_offset + k - count];
-    current_screen_->attr[line_offset + k] =
-        current_screen_->attr[line_offset + k - count];
+    cells[k] = cells[k - count];
   }
 
-  Attr attr = EffectiveAttribute();
+  while (k-- > static_cast<size_t>(current_screen_->cursor_x)) cells[k] = blank;
 
-  while (k-- > static_cast<size_t>(current_screen_->cursor_x)) {
-    current_screen_->chars[line_offset + k] = ' ';
-    current_screen_->attr[line_offset + k] = attr;
-  }
+  DamageRow(current_screen_->cursor_y);
 }
 
 void Terminal::DeleteChars(size_t count) {
-  size_t line_offset =
-      (current_screen_->scroll_line + current_screen_->cursor_y) %
-      history_size * size_.ws_col;
+  Cell* cells = LineCells(RowLine(current_screen_->cursor_y));
+  Cell blank{L' ', InternAttr(EffectiveAttribute())};
   size_t k = current_screen_->cursor_x;
 
-  for (; k + count < size_.ws_col; ++k) {
-    current_screen_->chars[line_offset + k] =
-        current_screen_->chars[line_offset + k + count];
-    current_screen_->attr[line_offset + k] =
-        current_screen_->attr[line_offset + k + count];
-  }
+  for (; k + count < size_.ws_col; ++k) cells[k] = cells[k + count];
 
-  Attr attr = EffectiveAttribute();
+  for (; k < size_.ws_col; ++k) cells[k] = blank;
 
-  for (; k < size_.ws_col; ++k) {
-    current_screen_->chars[line_offset + k] = ' ';
-    current_screen_->attr[line_offset + k] = attr;
-  }
+  DamageRow(current_screen_->cursor_y);
 }
 
 void Terminal::AddChar(int ch) {
@@ -1112,133 +1678,424 @@ void Terminal::AddChar(int ch) {
 
   if (ch < 32) return;
 
-  size_t offset = (current_screen_->scroll_line + current_screen_->cursor_y) %
-                      history_size * size_.ws_col +
-                  current_screen_->cursor_x;
+  Cell* cell = &LineCells(RowLine(current_screen_->cursor_y))
+                    [current_screen_->cursor_x];
+
+  DamageRow(current_screen_->cursor_y);
 
   if (ch == 0x7f || ch >= 65536) {
-    current_screen_->chars[offset] = ' ';
-    current_screen_->attr[offset] = EffectiveAttribute();
+    *cell = Cell{L' ', InternAttr(EffectiveAttribute())};
     return;
   }
 
   if (insertmode) InsertChars(1);
 
-  current_screen_->chars[offset] = ch;
-  current_screen_->attr[offset] = EffectiveAttribute();
+  *cell = Cell{ch, InternAttr(EffectiveAttribute())};
   ++current_screen_->cursor_x;
 }
 
-void Terminal::NormalizeHistoryBuffer() {
-  size_t history_buffer_size = size_.ws_col * history_size;
+void Terminal::ClearLineWithAttr(size_t line, int ch, const Attr& attr) {
+  std::fill(LineCells(line), LineCells(line) + size_.ws_col,
+            Cell{ch, InternAttr(attr)});
 
-  for (size_t i = 0; i < 2; ++i) {
-    if (!screens_[i].scroll_line) continue;
+  const size_t line_count = current_screen_->line_count;
+  const size_t row =
+      (line + line_count - current_screen_->scroll_line) % line_count;
+  if (row < size_.ws_row) DamageRow(row);
+}
 
-    assert(screens_[i].scroll_line > 0);
-    assert(screens_[i].scroll_line < history_size);
+void Terminal::DamageRows(size_t first, size_t count) {
+  ++generation_;
+  std::fill(row_generations_.begin() + first,
+            row_generations_.begin() + first + count, generation_);
+}
 
-    size_t buffer_offset = screens_[i].scroll_line * size_.ws_col;
+void Terminal::ResetScreen(Screen* screen, size_t line_count,
+                           const Cell& blank) {
+  size_t hot_history =
+      std::min(kHotHistory + kFreezeBatch, line_count - size_.ws_row);
+  size_t hot_lines = size_.ws_row + hot_history;
+
+  const bool zero_blank = !blank.ch && !blank.attr;
+
+  screen->line_count = line_count;
+  screen->hot_lines = hot_lines;
+  screen->hot_history = hot_history;
+  screen->free_rows.clear();
+  screen->lines.reset(ZeroedArray<uint32_t>(line_count));
+  screen->cells.reset(ZeroedArray<Cell>((hot_lines + 1) * size_.ws_col));
+  if (!zero_blank) {
+    std::fill(&screen->cells[size_.ws_col],
+              &screen->cells[(hot_lines + 1) * size_.ws_col], blank);
+  }
 
-    std::unique_ptr<CharacterType[]> tmpchars(new CharacterType[buffer_offset]);
-    std::unique_ptr<Attr[]> tmpattrs(new Attr[buffer_offset]);
+  // The screen starts at line 0, with the hot history right before it at the
+  // end of the ring buffer.  All other lines are cold.
+  for (size_t row = 0; row < size_.ws_row; ++row) screen->lines[row] = row + 1;
+  for (size_t i = 0; i < hot_history; ++i)
+    screen->lines[line_count - hot_history + i] = size_.ws_row + i + 1;
 
-    memcpy(&tmpchars[0], &screens_[i].chars[0],
-           sizeof(CharacterType) * buffer_offset);
-    memcpy(&tmpattrs[0], &screens_[i].attr[0], sizeof(Attr) * buffer_offset);
+  screen->cold_pages.clear();
+  screen->cold_pages.resize((line_count + kColdPageSize - 1) / kColdPageSize);
 
-    memmove(&screens_[i].chars[0], &screens_[i].chars[buffer_offset],
-            sizeof(CharacterType) * (history_buffer_size - buffer_offset));
-    memmove(&screens_[i].attr[0], &screens_[i].attr[buffer_offset],
-            sizeof(Attr) * (history_buffer_size - buffer_offset));
+  if (!zero_blank) {
+    unsigned char cold_line[kMaxBlankLineSize];
+    const size_t size =
+        PutBlankLine(cold_line, blank.ch, attrs_[blank.attr]) - cold_line;
 
-    memcpy(&screens_[i].chars[history_buffer_size - buffer_offset],
-           &tmpchars[0], sizeof(CharacterType) * buffer_offset);
-    memcpy(&screens_[i].attr[history_buffer_size - buffer_offset], &tmpattrs[0],
-           sizeof(Attr) * buffer_offset);
+    for (size_t line = 0; line < line_count; ++line) {
+      if (screen->lines[line] == kColdLine)
+        MutableColdLine(screen, line)->assign(
+            reinterpret_cast<char*>(cold_line), size);
+    }
+  }
+
+  screen->blank_history = line_count - size_.ws_row;
+  screen->scroll_line = 0;
+  cold_chars_screen_ = nullptr;
+}
+
+const std::string* Terminal::ColdLine(const Screen& screen, size_t line) {
+  const auto& page = screen.cold_pages[line / kColdPageSize];
+  if (!page || page[line % kColdPageSize].empty()) return nullptr;
+  return &page[line % kColdPageSize];
+}
 
-    screens_[i].scroll_line = 0;
+std::string* Terminal::MutableColdLine(Screen* screen, size_t line) {
+  auto& page = screen->cold_pages[line / kColdPageSize];
+  if (!page) page.reset(new std::string[kColdPageSize]);
+  return &page[line % kColdPageSize];
+}
+
+uint32_t Terminal::FreezeLine(size_t line) {
+  uint32_t row = current_screen_->lines[line];
+  size_t size = EncodeLine(&current_screen_->cells[row * size_.ws_col]);
+
+  MutableColdLine(current_screen_, line)
+      ->assign(reinterpret_cast<char*>(freeze_buffer_.data()), size);
+
+  current_screen_->lines[line] = kColdLine;
+  if (cold_chars_screen_ == current_screen_ && cold_chars_line_ == line)
+    cold_chars_screen_ = nullptr;
+
+  return row;
+}
+
+void Terminal::FreezeHistory() {
+  Screen* screen = current_screen_;
+
+  // Oldest first, so that the hot history stays right above the screen.
+  for (; screen->hot_history > kHotHistory; --screen->hot_history) {
+    size_t line = (screen->scroll_line + screen->line_count -
+                   screen->hot_history) %
+                  screen->line_count;
+    screen->free_rows.push_back(FreezeLine(line));
   }
 }
 
-void Terminal::ClearLineWithAttr(size_t line, int ch, const Attr& attr) {
-  size_t offset = line * size_.ws_col;
+size_t Terminal::EncodeLine(const Cell* cells) {
+  const Cell& fill = cells[size_.ws_col - 1];
+  const size_t count = TrimmedLength(cells, size_.ws_col);
+
+  // Worst case: every cell has its own attribute run.
+  freeze_buffer_.resize((2 * kMaxVarintSize + kAttrSize) * (size_.ws_col + 2));
+  unsigned char* output = freeze_buffer_.data();
+
+  // Most lines are a single run of narrow characters.
+  if (count) {
+    output = PutVarint(output, count * 2);
+    output = PutVarint(output, fill.ch);
+    output = PutAttr(output, attrs_[fill.attr]);
+    output = PutVarint(output, count);
+    output = PutAttr(output, attrs_[cells[0].attr]);
+
+    if (NarrowCells(output, cells, count, cells[0].attr))
+      return output + count - freeze_buffer_.data();
+
+    output = freeze_buffer_.data();
+  }
+
+  uint32_t wide = 0;
+  for (size_t i = 0; i < count; ++i) wide |= cells[i].ch;
+  wide = wide > 0xff;
+
+  output = PutVarint(output, count * 2 + wide);
+  output = PutVarint(output, fill.ch);
+  output = PutAttr(output, attrs_[fill.attr]);
+
+  for (size_t i = 0; i < count;) {
+    uint32_t attr = cells[i].attr;
+    size_t end = i + 1;
+    while (end < count && cells[end].attr == attr) ++end;
+    output = PutVarint(output, end - i);
+    output = PutAttr(output, attrs_[attr]);
+    i = end;
+  }
+
+  if (wide) {
+    for (size_t i = 0; i < count; ++i) output = PutVarint(output, cells[i].ch);
+  } else {
+    for (size_t i = 0; i < count; ++i) *output++ = cells[i].ch;
+  }
+
+  return output - freeze_buffer_.data();
+}
+
+void Terminal::DecodeLine(const unsigned char* data, CharacterType* chars,
+                          Attr* attr) const {
+  if (data) {
+    DecodeColdLine(data, size_.ws_col, chars, attr);
+    return;
+  }
+
+  std::fill(chars, chars + size_.ws_col, 0);
+  if (attr) std::fill(attr, attr + size_.ws_col, attrs_[0]);
+}
+
+void Terminal::SpillLine(const Screen& screen, size_t line) {
+  if (screen.lines[line] == kColdLine) {
+    if (const std::string* cold_line = ColdLine(screen, line)) {
+      history_file_.Append(cold_line->data(), cold_line->size());
+    } else {
+      unsigned char blank[kMaxBlankLineSize];
+      history_file_.Append(blank, PutBlankLine(blank, 0, attrs_[0]) - blank);
+    }
+  } else {
+    size_t size = EncodeLine(&screen.cells[screen.lines[line] * size_.ws_col]);
+    history_file_.Append(freeze_buffer_.data(), size);
+  }
+}
+
+void Terminal::SpillHistory(size_t rows) {
+  const Screen& screen = screens_[0];
+  const size_t line_count = screen.line_count;
+
+  // Oldest first.
+  for (size_t i = line_count - size_.ws_row - screen.blank_history; i > 0; --i)
+    SpillLine(screen, (screen.scroll_line + line_count - i) % line_count);
+
+  for (size_t row = 0; row < rows; ++row)
+    SpillLine(screen, (screen.scroll_line + row) % line_count);
+}
+
+const Terminal::CharacterType* Terminal::ColdLineChars(size_t line) const {
+  if (cold_chars_screen_ != current_screen_ || cold_chars_line_ != line) {
+    cold_chars_.resize(size_.ws_col);
+    DecodeLine(LineData(ColdLine(*current_screen_, line)), cold_chars_.data(),
+               nullptr);
+    cold_chars_screen_ = current_screen_;
+    cold_chars_line_ = line;
+  }
+
+  return cold_chars_.data();
+}
+
+const Terminal::CharacterType* Terminal::FileLineChars(size_t index) const {
+  if (file_chars_index_ != index) {
+    file_chars_.resize(size_.ws_col);
+    DecodeLine(history_file_.Line(index), file_chars_.data(), nullptr);
+    file_chars_index_ = index;
+  }
+
+  return file_chars_.data();
+}
+
+bool Terminal::MapRow(size_t* row) const {
+  if (*row >= size_.ws_row && current_screen_ == &screens_[0] &&
+      history_file_.IsOpen()) {
+    // The history file comes right above the written part of the history in
+    // the ring buffer.
+    size_t file_lines = history_file_.Size();
+    if (*row - size_.ws_row < file_lines) {
+      *row -= size_.ws_row;
+      return true;
+    }
+
+    *row += current_screen_->blank_history - file_lines;
+  }
+
+  *row = (current_screen_->scroll_line + *row) % current_screen_->line_count;
+  return false;
+}
+
+Terminal::CharacterType Terminal::CharAt(size_t position) const {
+  position %= size_.ws_col * HistoryLines();
+  size_t line = position / size_.ws_col;
+
+  if (MapRow(&line)) return FileLineChars(line)[position % size_.ws_col];
+
+  if (current_screen_->lines[line] == kColdLine)
+    return ColdLineChars(line)[position % size_.ws_col];
+
+  return LineCells(line)[position % size_.ws_col].ch;
+}
 
-  std::fill(&current_screen_->chars[offset],
-            &current_screen_->chars[offset + size_.ws_col], ch);
-  std::fill(&current_screen_->attr[offset],
-            &current_screen_->attr[offset + size_.ws_col], attr);
+uint32_t Terminal::InternAttr(const Attr& attr) {
+  uint64_t key = AttrKey(attr);
+  if (key == last_attr_key_) return last_attr_index_;
+
+  auto i = attr_indexes_.find(key);
+
+  if (i == attr_indexes_.end()) {
+    if (attrs_.size() >= attrs_limit_) CompactAttrs();
+
+    i = attr_indexes_.emplace(key, attrs_.size()).first;
+    attrs_.push_back(attr);
+  }
+
+  last_attr_key_ = key;
+  last_attr_index_ = i->second;
+
+  return i->second;
 }
 
-void Terminal::Scroll(bool fromcursor) {
+void Terminal::CompactAttrs() {
+  std::vector<uint32_t> remap(attrs_.size(), UINT32_MAX);
+  std::vector<Attr> attrs(1, attrs_[0]);
+
+  remap[0] = 0;
+  attr_indexes_.clear();
+  attr_indexes_[AttrKey(attrs_[0])] = 0;
+
+  for (auto& screen : screens_) {
+    if (!screen.cells) continue;
+
+    for (size_t i = 0; i < size_.ws_col * (screen.hot_lines + 1); ++i) {
+      uint32_t& index = screen.cells[i].attr;
+
+      if (remap[index] == UINT32_MAX) {
+        remap[index] = attrs.size();
+        attr_indexes_[AttrKey(attrs_[index])] = attrs.size();
+        attrs.push_back(attrs_[index]);
+      }
+
+      index = remap[index];
+    }
+  }
+
+  attrs_.swap(attrs);
+  attrs_limit_ = std::max(kMinAttrsLimit, attrs_.size() * 2);
+  last_attr_key_ = AttrKey(attrs_[0]);
+  last_attr_index_ = 0;
+}
+
+void Terminal::Scroll(bool fromcursor, size_t count) {
+  scroll_count_ += count;
+
   if (!fromcursor && scrolltop == 0 && scrollbottom == size_.ws_row) {
-    ClearLine((current_screen_->scroll_line + size_.ws_row) % history_size);
-    current_screen_->scroll_line =
-        (current_screen_->scroll_line + 1) % history_size;
+    const size_t line_count = current_screen_->line_count;
+
+    screen_scroll_count_ += count;
+
+    // The rows that move up keep the generations they last changed in.
+    ++generation_;
+    if (count < size_.ws_row) {
+      std::rotate(row_generations_.begin(), row_generations_.begin() + count,
+                  row_generations_.end());
+      std::fill(row_generations_.end() - count, row_generations_.end(),
+                generation_);
+    } else {
+      std::fill(row_generations_.begin(), row_generations_.end(), generation_);
+    }
+    scroll_generation_ = generation_;
+
+    while (count--) {
+      // The line scrolling in at the bottom overwrites the oldest line in the
+      // history, while the top row joins the hot history.
+      size_t line = (current_screen_->scroll_line + size_.ws_row) % line_count;
+
+      if (current_screen_->blank_history)
+        --current_screen_->blank_history;
+      else if (current_screen_ == &screens_[0] && history_file_.IsOpen())
+        SpillLine(*current_screen_, line);
+
+      if (current_screen_->lines[line] == kColdLine) {
+        // Cold lines only get their storage back in batches.
+        if (current_screen_->free_rows.empty()) FreezeHistory();
+        current_screen_->lines[line] = current_screen_->free_rows.back();
+        current_screen_->free_rows.pop_back();
+        ++current_screen_->hot_history;
+
+        // Keeps the capacity for when the line is compressed again.
+        auto& page = current_screen_->cold_pages[line / kColdPageSize];
+        if (page) page[line % kColdPageSize].clear();
+      }
+
+      ClearLine(line);
+      current_screen_->scroll_line =
+          (current_screen_->scroll_line + 1) % line_count;
+    }
 
     return;
   }
 
-  NormalizeHistoryBuffer();
-
-  size_t first, length;
+  size_t first, height;
 
   if (fromcursor) {
     // TODO(mortehu): See what other terminals do in this case.
     if (current_screen_->cursor_y >= scrollbottom) return;
     first = current_screen_->cursor_y;
-    length = (scrollbottom - current_screen_->cursor_y - 1);
+    height = scrollbottom - current_screen_->cursor_y;
   } else {
     first = scrolltop;
-    length = (scrollbottom - scrolltop - 1);
+    height = scrollbottom - scrolltop;
   }
 
-  memmove(&current_screen_->chars[first * size_.ws_col],
-          &current_screen_->chars[(first + 1) * size_.ws_col],
-          length * size_.ws_col * sizeof(CharacterType));
-  std::fill(&current_screen_->chars[(first + length) * size_.ws_col],
-            &current_screen_->chars[(first + length + 1) * size_.ws_col], ' ');
-
-  memmove(&current_screen_->attr[first * size_.ws_col],
-          &current_screen_->attr[(first + 1) * size_.ws_col],
-          length * size_.ws_col * sizeof(Attr));
-  std::fill(&current_screen_->attr[(first + length) * size_.ws_col],
-            &current_screen_->attr[(first + length + 1) * size_.ws_col],
-            EffectiveAttribute());
+  count = std::min(count, height);
+
+  // Reuse the storage of the lines scrolled out at the top for the new lines
+  // at the bottom.
+  RotateLines(first, height, count);
+  DamageRows(first, height);
+
+  for (size_t row = first + height - count; row < first + height; ++row)
+    ClearLine(RowLine(row));
 }
 
-void Terminal::ReverseScroll(bool fromcursor) {
-  NormalizeHistoryBuffer();
+void Terminal::ReverseScroll(bool fromcursor, size_t count) {
+  scroll_count_ += count;
 
-  size_t first, length;
+  size_t first, height;
 
   if (fromcursor) {
     if (current_screen_->cursor_y + 1 >= scrollbottom) return;
     first = current_screen_->cursor_y;
-    length = (scrollbottom - 1 - current_screen_->cursor_y);
+    height = scrollbottom - current_screen_->cursor_y;
   } else {
     if (scrolltop + 1 >= scrollbottom) return;
     first = scrolltop;
-    length = (scrollbottom - scrolltop - 1);
+    height = scrollbottom - scrolltop;
   }
 
-  memmove(&current_screen_->chars[(first + 1) * size_.ws_col],
-          &current_screen_->chars[first * size_.ws_col],
-          length * size_.ws_col * sizeof(CharacterType));
-  std::fill(&current_screen_->chars[first * size_.ws_col],
-            &current_screen_->chars[(first + 1) * size_.ws_col], ' ');
-
-  memmove(&current_screen_->attr[(first + 1) * size_.ws_col],
-          &current_screen_->attr[first * size_.ws_col],
-          length * size_.ws_col * sizeof(Attr));
-  std::fill(&current_screen_->attr[first * size_.ws_col],
-            &current_screen_->attr[(first + 1) * size_.ws_col],
-            EffectiveAttribute());
+  count = std::min(count, height);
+
+  RotateLines(first, height, height - count);
+  DamageRows(first, height);
+
+  for (size_t row = first; row < first + count; ++row) ClearLine(RowLine(row));
 }
 
-void Terminal::Select(RangeType range_type) {
-  NormalizeHistoryBuffer();
+void Terminal::RotateLines(size_t first, size_t height, size_t shift) {
+  if (shift == 0 || shift == height) return;
+
+  uint32_t* lines = current_screen_->lines.get();
+  rotate_buffer_.resize(height);
+
+  for (size_t i = 0, line = RowLine(first); i < height; ++i) {
+    rotate_buffer_[i] = lines[line];
+    if (++line == current_screen_->line_count) line = 0;
+  }
+
+  std::rotate(rotate_buffer_.begin(), rotate_buffer_.begin() + shift,
+              rotate_buffer_.end());
 
+  for (size_t i = 0, line = RowLine(first); i < height; ++i) {
+    lines[line] = rotate_buffer_[i];
+    if (++line == current_screen_->line_count) line = 0;
+  }
+}
+
+void Terminal::Select(RangeType range_type) {
   select_end =
       current_screen_->cursor_y * size_.ws_col + current_screen_->cursor_x;
 
@@ -1253,9 +2110,6 @@ void Terminal::Select(RangeType range_type) {
 
 bool Terminal::FindRange(RangeType range_type, size_t* begin,
                          size_t* end) const {
-  size_t history_buffer_size = size_.ws_col * history_size;
-  size_t offset = current_screen_->scroll_line * size_.ws_col;
-
   size_t i;
   int ch;
 
@@ -1278,7 +2132,7 @@ bool Terminal::FindRange(RangeType range_type, size_t* begin,
       while (i) {
         if (!(i % size_.ws_col)) break;
 
-        ch = current_screen_->chars[(offset + i - 1) % history_buffer_size];
+        ch = CharAt(i - 1);
 
         if (ch <= 32 || ch == 0x7f || strchr("\'\"()[]{}<>,`", ch)) break;
 
@@ -1290,7 +2144,7 @@ bool Terminal::FindRange(RangeType range_type, size_t* begin,
       i = *end;
 
       while ((i % size_.ws_col) < size_.ws_col) {
-        ch = current_screen_->chars[(offset + i) % history_buffer_size];
+        ch = CharAt(i);
 
         if (ch <= 32 || ch == 0x7f || strchr("\'\"()[]{}<>,`", ch)) break;
 
@@ -1306,7 +2160,7 @@ bool Terminal::FindRange(RangeType range_type, size_t* begin,
       i = *begin;
 
       while (i > 0) {
-        ch = current_screen_->chars[(offset + i) % history_buffer_size];
+        ch = CharAt(i);
 
         if ((!ch || ((i + 1) % size_.ws_col == 0) || isspace(ch)) &&
             !paren_level) {
@@ -1328,10 +2182,7 @@ bool Terminal::FindRange(RangeType range_type, size_t* begin,
 
       *begin = i;
 
-      if (*end > i + 1 &&
-          current_screen_->chars[(offset + *end - 1) % history_buffer_size] ==
-              '=')
-        --*end;
+      if (*end > i + 1 && CharAt(*end - 1) == '=') --*end;
 
       return true;
     }
@@ -1341,53 +2192,59 @@ bool Terminal::FindRange(RangeType range_type, size_t* begin,
 }
 
 std::string Terminal::GetTextInRange(size_t begin, size_t end) const {
-  if (begin == end) return std::string();
-
-  size_t history_buffer_size = size_.ws_col * history_size;
-  size_t offset = current_screen_->scroll_line * size_.ws_col;
-
   if (begin > end) std::swap(begin, end);
 
-  size_t last_graph = 0;
-  size_t last_graph_col = 0;
-  size_t i = begin;
-
+  TextRange range(begin, end);
   std::string result;
+  ReadText(&range, SIZE_MAX, &result);
 
-  while (i != end) {
-    int ch = current_screen_->chars[(i + offset) % history_buffer_size];
-    size_t width = size_.ws_col;
-
-    if (ch == 0 || ch == 0xffff) ch = ' ';
-
-    if (i > begin && (i % width) == 0) {
-      result.resize(last_graph);
-      if (last_graph_col != (width - 1)) result.push_back('\n');
-      last_graph = result.size();
-    }
+  return result;
+}
 
-    if (ch < 0x80) {
-      result.push_back(ch);
-    } else if (ch < 0x800) {
-      result.push_back(0xC0 | (ch >> 6));
-      result.push_back(0x80 | (ch & 0x3F));
-    } else if (ch < 0x10000) {
-      result.push_back(0xE0 | (ch >> 12));
-      result.push_back(0x80 | ((ch >> 6) & 0x3F));
-      result.push_back(0x80 | (ch & 0x3f));
-    }
+void Terminal::ReadText(TextRange* range, size_t max_size,
+                        std::string* text) const {
+  const size_t width = size_.ws_col;
+  const size_t start_size = text->size();
+  size_t i = range->begin;
+
+  while (i != range->end && text->size() - start_size < max_size) {
+    // Lines that did not wrap into the next end with a newline.
+    if (range->started && (i % width) == 0 &&
+        range->last_graph_col != (width - 1))
+      text->push_back('\n');
+    range->started = true;
+
+    const size_t line_end = std::min(range->end, (i / width + 1) * width);
+
+    // Trailing blanks are trimmed.
+    size_t last_graph = text->size();
+
+    for (; i != line_end; ++i) {
+      int ch = CharAt(i);
+
+      if (ch == 0 || ch == 0xffff) ch = ' ';
+
+      if (ch < 0x80) {
+        text->push_back(ch);
+      } else if (ch < 0x800) {
+        text->push_back(0xC0 | (ch >> 6));
+        text->push_back(0x80 | (ch & 0x3F));
+      } else if (ch < 0x10000) {
+        text->push_back(0xE0 | (ch >> 12));
+        text->push_back(0x80 | ((ch >> 6) & 0x3F));
+        text->push_back(0x80 | (ch & 0x3f));
+      }
 
-    if (ch != ' ') {
-      last_graph = result.size();
-      last_graph_col = i % width;
+      if (ch != ' ') {
+        last_graph = text->size();
+        range->last_graph_col = i % width;
+      }
     }
 
-    ++i;
+    text->resize(last_graph);
   }
 
-  if (last_graph < result.size()) result.resize(last_graph);
-
-  return result;
+  range->begin = i;
 }
 
 std::string Terminal::GetCurrentLine(bool to_cursor) const {
@@ -1,11 +1,15 @@
 #ifndef TERMINAL_H_
 #define TERMINAL_H_ 1
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <sys/ioctl.h>
@@ -13,6 +17,8 @@
 
 #include <X11/X.h>
 
+#include "history-file.h"
+
 #define ATTR_BLINK 0x0001
 #define ATTR_HIGHLIGHT 0x0002
 #define ATTR_BOLD 0x0004
@@ -72,17 +78,81 @@ class Terminal {
     uint8_t extra;
   };
 
+  // A character cell as stored in the history buffer.  `attr' is an index
+  // into the terminal's table of distinct attributes, so a cell takes 8 bytes
+  // instead of sizeof(CharacterType) + sizeof(Attr).
+  struct Cell {
+    CharacterType ch;
+    uint32_t attr;
+  };
+
+  // Frees arrays allocated with calloc, whose pages stay shared zero pages
+  // until they are written to.
+  struct FreeDeleter {
+    void operator()(void* pointer) const { free(pointer); }
+  };
+
   struct Screen {
-    Screen() : scroll_line(), cursor_x(), cursor_y(), use_alt_charset() {}
+    Screen()
+        : line_count(),
+          hot_lines(),
+          hot_history(),
+          blank_history(),
+          scroll_line(),
+          cursor_x(),
+          cursor_y(),
+          use_alt_charset() {}
+
+    // Number of lines in the history ring buffer: the rows, plus the history
+    // on the main screen.  The alternate screen has none.
+    size_t line_count;
+
+    // Number of storage rows for uncompressed lines: the rows, plus up to
+    // kHotHistory + kFreezeBatch lines of history.
+    size_t hot_lines;
+
+    // Number of history lines right above the screen that are uncompressed.
+    // The other storage rows are listed in `free_rows'.
+    size_t hot_history;
+    std::vector<uint32_t> free_rows;
+
+    // Storage row of each line in the history ring buffer, or kColdLine if
+    // the line is only kept compressed in `cold_pages'.  Scrolling a region
+    // only rotates these indices.
+    std::unique_ptr<uint32_t[], FreeDeleter> lines;
+
+    // Uncompressed lines: the visible rows and the most recent history,
+    // starting at storage row 1.
+    std::unique_ptr<Cell[], FreeDeleter> cells;
+
+    // Compressed contents of the cold lines, in pages of kColdPageSize lines
+    // that are allocated when one of their lines is first written.  Lines in
+    // missing pages, and empty lines, are blank.
+    std::vector<std::unique_ptr<std::string[]>> cold_pages;
+
+    // History lines that are still blank from ResetScreen, and so are not
+    // worth spilling to the history file.
+    size_t blank_history;
 
-    std::unique_ptr<CharacterType[]> chars;
-    std::unique_ptr<Attr[]> attr;
     size_t scroll_line;
     int cursor_x, cursor_y;
     bool use_alt_charset;
   };
 
   struct State {
+    State()
+        : width(),
+          height(),
+          cursor_x(),
+          cursor_y(),
+          selection_begin(),
+          selection_end(),
+          cursor_hidden(),
+          focused(),
+          generation(),
+          scroll_count(),
+          history_scroll() {}
+
     size_t width, height;
     std::vector<CharacterType> chars;
     std::vector<Attr> attr;
@@ -94,6 +164,28 @@ class Terminal {
 
     // Next predicted keystrokes.
     std::vector<char> completion_hint;
+
+    // What the rows were copied from, so that UpdateState can tell which of
+    // them are out of date.
+    uint64_t generation;
+    uint64_t scroll_count;
+    unsigned int history_scroll;
+  };
+
+  // A range of text being read in pieces with ReadText.
+  struct TextRange {
+    TextRange() : begin(), end(), last_graph_col(), started() {}
+    TextRange(size_t begin, size_t end)
+        : begin(begin), end(end), last_graph_col(), started() {}
+
+    bool empty() const { return begin == end; }
+
+    size_t begin, end;
+
+    // Column of the last non-blank character read, which tells whether the
+    // line wrapped into the next.
+    size_t last_graph_col;
+    bool started;
   };
 
   Terminal(std::function<void(const void*, size_t)>&& write_function);
@@ -107,14 +199,48 @@ class Terminal {
   void Resize(unsigned int width, unsigned int height, unsigned int space_width,
               unsigned int line_height);
 
+  // Spills the lines that scroll out of the main screen's history to a file
+  // in `directory', so that history_scroll and selections can still reach
+  // them.  Returns false and sets errno on failure.
+  bool OpenHistoryFile(const char* directory) {
+    return history_file_.Open(directory);
+  }
+
+  // Number of lines history_scroll and selections can reach, including the
+  // screen itself.  Positions are counted from the top of the screen, modulo
+  // this many lines.  With a history file, history that is still blank after
+  // Init or Resize is left out, so that it does not separate the file from
+  // the rest of the history.
+  size_t HistoryLines() const {
+    if (current_screen_ != &screens_[0] || !history_file_.IsOpen())
+      return current_screen_->line_count;
+    return history_size - screens_[0].blank_history + history_file_.Size();
+  }
+
   void ProcessData(const void* buf, size_t count);
   void GetState(State* state) const;
+
+  // Like GetState, but for a `state' last filled in by GetState or
+  // UpdateState of this terminal, copies only the rows that changed since.
+  // Scrolling the whole screen shifts the rows already in `state'.
+  void UpdateState(State* state) const;
   std::string GetTextInRange(size_t begin, size_t end) const;
 
+  // Appends whole lines from the start of `range' to `text', until at least
+  // `max_size' bytes are appended or the range is used up, and moves the
+  // start of the range past them.  Reading a range to the end gives the same
+  // text as GetTextInRange, unless the lines are changed in between.
+  void ReadText(TextRange* range, size_t max_size, std::string* text) const;
+
   std::string GetSelection() const {
     return GetTextInRange(select_begin, select_end);
   }
 
+  TextRange SelectionRange() const {
+    return TextRange(std::min(select_begin, select_end),
+                     std::max(select_begin, select_end));
+  }
+
   std::string GetCurrentLine(bool to_cursor = false) const;
 
   void Select(RangeType range_type);
@@ -130,12 +256,28 @@ class Terminal {
 
   const winsize& Size() const { return size_; }
 
+  // Number of lines scrolled in either direction since construction.
+  uint64_t ScrollCount() const { return scroll_count_; }
+
+  // Returns the generation of the most recent change to the screen contents.
+  // Moving the cursor or the selection, and changing history_scroll, are not
+  // counted as changes.
+  uint64_t Generation() const { return generation_; }
+
+  // Returns true if screen row `row' changed after generation `since'.
+  // Scrolling the whole screen changes every row.
+  bool RowDamaged(size_t row, uint64_t since) const {
+    return row_generations_[row] > since || scroll_generation_ > since;
+  }
+
+  // Stores the screen rows that changed after generation `since' in `rows',
+  // top to bottom.
+  void GetDamagedRows(uint64_t since, std::vector<size_t>* rows) const;
+
   bool reverse;
   size_t history_size;
   int scrolltop;
   int scrollbottom;
-  int escape;
-  int param[8];
   bool appcursor;
   bool hide_cursor;
   bool insertmode;
@@ -147,20 +289,142 @@ class Terminal {
 
   bool bracketed_paste{};
 
+  // Set by DEC private mode 2026 while the application is drawing a frame
+  // that should not be shown until it is complete.
+  bool synchronized_output{};
+
+  // Incremented whenever synchronized output is turned on, so that callers
+  // can tell when a new frame started, even within one ProcessData call.
+  uint64_t synchronized_output_frames{};
+
   unsigned int history_scroll;
 
  private:
-  void NormalizeHistoryBuffer();
-  void Scroll(bool fromcursor);
-  void ReverseScroll(bool fromcursor);
+  // Handles printable ASCII, well-formed UTF-8, carriage return and line
+  // feed, and returns a pointer to the first byte it could not handle.
+  const unsigned char* ProcessText(const unsigned char* begin,
+                                   const unsigned char* end);
+
+  // Runs the table driven escape sequence parser, returning as soon as no
+  // escape sequence or UTF-8 sequence is in progress so that ProcessData can
+  // go back to ProcessText.
+  const unsigned char* ProcessEscapes(const unsigned char* begin,
+                                      const unsigned char* end);
+
+  // Parser actions.
+  void Print(unsigned char ch);
+  void Execute(unsigned char ch);
+  void EscDispatch(unsigned char final);
+  void CsiDispatch(unsigned char final);
+
+  void SetDECModes(bool enable);
+
+  // Answers DECRQM for DEC private mode `mode'.
+  void ReportDECMode(int mode);
+
+  // Returns the history ring buffer line shown at screen row `row'.
+  size_t RowLine(int row) const {
+    return (current_screen_->scroll_line + row) % current_screen_->line_count;
+  }
+
+  Cell* LineCells(size_t line) const {
+    return &current_screen_->cells[current_screen_->lines[line] * size_.ws_col];
+  }
+
+  // Maps `*row', counted from the top of the screen modulo HistoryLines(), to
+  // a line of the history file and returns true, or to a history ring buffer
+  // line and returns false.
+  bool MapRow(size_t* row) const;
+
+  // Copies screen row `row', as seen with the current history_scroll, into
+  // `state'.
+  void CopyRow(size_t row, State* state) const;
 
-  void SetScreen(int screen) { current_screen_ = &screens_[screen]; }
+  // Fills in the parts of `state' other than the rows.
+  void CopyCursorAndSelection(State* state) const;
+
+  // Returns the character `position' cells from the top of the screen,
+  // modulo HistoryLines() lines.
+  CharacterType CharAt(size_t position) const;
+
+  // Allocates `line_count' lines for `screen', all set to `blank', at the
+  // current width.  As long as `blank' is all zero bytes, none of the history
+  // is touched until it is written to.
+  void ResetScreen(Screen* screen, size_t line_count, const Cell& blank);
+
+  // Returns the compressed contents of cold line `line' of `screen', or
+  // nullptr if the line is blank.
+  static const std::string* ColdLine(const Screen& screen, size_t line);
+
+  // Returns cold line `line' of `screen' for writing, allocating its page if
+  // necessary.
+  static std::string* MutableColdLine(Screen* screen, size_t line);
+
+  // Compresses history ring buffer line `line', and returns the storage row
+  // it used.
+  uint32_t FreezeLine(size_t line);
+
+  // Compresses the oldest hot history lines of the current screen down to
+  // kHotHistory, and adds their storage rows to `free_rows'.
+  void FreezeHistory();
+
+  // Compresses the `size_.ws_col' cells at `cells' into `freeze_buffer_', and
+  // returns the size of the result.
+  size_t EncodeLine(const Cell* cells);
+
+  // Decodes a line compressed by EncodeLine, or a blank line if `data' is
+  // null, into `chars' and, unless null, `attr'.
+  void DecodeLine(const unsigned char* data, CharacterType* chars,
+                  Attr* attr) const;
+
+  // Appends history ring buffer line `line' of `screen' to the history file.
+  void SpillLine(const Screen& screen, size_t line);
+
+  // Spills the history of the main screen followed by its top `rows' rows,
+  // which Resize is about to discard.
+  void SpillHistory(size_t rows);
+
+  // Returns the characters of cold line `line', decoded into a cache.
+  const CharacterType* ColdLineChars(size_t line) const;
+
+  // Returns the characters of history file line `index', decoded into a
+  // cache.
+  const CharacterType* FileLineChars(size_t index) const;
+
+  // Returns the index of `attr' in `attrs_', adding it if necessary.
+  uint32_t InternAttr(const Attr& attr);
+
+  // Drops the attributes no longer referenced by any cell from `attrs_', and
+  // renumbers the cells.
+  void CompactAttrs();
+
+  // Scrolls the scroll region, or the part of it from the cursor down, by
+  // `count' lines at once.
+  void Scroll(bool fromcursor, size_t count = 1);
+  void ReverseScroll(bool fromcursor, size_t count = 1);
+
+  // Rotates the line handles of screen rows [first, first + height) so that
+  // row `first' receives the line that was at row `first + shift'.
+  void RotateLines(size_t first, size_t height, size_t shift);
+
+  void SetScreen(int screen) {
+    current_screen_ = &screens_[screen];
+    DamageRows(0, size_.ws_row);
+  }
+
+  // Records a change to screen row `row', or to `count' rows starting at
+  // `first'.
+  void DamageRow(size_t row) { row_generations_[row] = ++generation_; }
+  void DamageRows(size_t first, size_t count);
 
   void InsertChars(size_t count);
   void DeleteChars(size_t count);
   void AddChar(int ch);
   void ClearLineWithAttr(size_t line, int ch, const Attr& attr);
 
+  static const uint32_t kColdLine = 0;
+  static const size_t kColdPageSize = 1024;
+
   void ClearLine(size_t line) {
     ClearLineWithAttr(line, ' ', EffectiveAttribute());
   }
@@ -180,6 +444,16 @@ class Terminal {
   unsigned int ansi_attribute_;
   Attr attribute_;
 
+  static const size_t kMaxParams = 16;
+
+  // Escape sequence parser state.  `parser_state_' is a ParserState from
+  // terminal.cc.
+  uint8_t parser_state_;
+  int params_[kMaxParams];
+  size_t param_count_;
+  unsigned char private_marker_;
+  unsigned char intermediate_;
+
   unsigned int ch_, nch_;
 
   int savedx_, savedy_;
@@ -187,6 +461,47 @@ class Terminal {
   std::string cursor_hint_;
 
   std::set<unsigned int> tab_stops_;
+
+  uint64_t scroll_count_ = 0;
+
+  // Incremented for every change to the screen contents.  Each screen row
+  // keeps the generation it last changed in.  When the whole screen
+  // scrolls, the rows keep their generations as they move up, and
+  // `scroll_generation_' records the change to all of them.
+  uint64_t generation_ = 0;
+  std::vector<uint64_t> row_generations_;
+  uint64_t scroll_generation_ = 0;
+
+  // Number of lines the whole screen has scrolled up since construction.
+  uint64_t screen_scroll_count_ = 0;
+
+  // Distinct attributes referenced by cells.  Index 0 is always the
+  // attribute of blank cells, the one in effect when Init was called.
+  std::vector<Attr> attrs_;
+  std::unordered_map<uint64_t, uint32_t> attr_indexes_;
+  size_t attrs_limit_;
+
+  // The most recently interned attribute, which is usually the next one
+  // asked for.
+  uint64_t last_attr_key_;
+  uint32_t last_attr_index_;
+
+  // Scratch space for RotateLines.
+  std::vector<uint32_t> rotate_buffer_;
+
+  // Scratch space for EncodeLine.
+  std::vector<unsigned char> freeze_buffer_;
+
+  // The cold line most recently decoded by ColdLineChars.
+  mutable std::vector<CharacterType> cold_chars_;
+  mutable const Screen* cold_chars_screen_;
+  mutable size_t cold_chars_line_;
+
+  HistoryFile history_file_;
+
+  // The history file line most recently decoded by FileLineChars, if any.
+  mutable std::vector<CharacterType> file_chars_;
+  mutable size_t file_chars_index_;
 };
 
 namespace std {
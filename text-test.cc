@@ -0,0 +1,143 @@
+// Checks that Terminal::GetTextInRange, and ReadText in pieces of any size,
+// give the same text as a straightforward reading of the characters on
+// random ranges, including ones reaching into cold and file history.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "terminal.h"
+
+namespace {
+
+// Returns every character the terminal can reach, indexed by position, as
+// seen through GetState at each possible history_scroll.
+std::vector<Terminal::CharacterType> ReadCharacters(Terminal* terminal) {
+  const size_t width = terminal->Size().ws_col;
+  const size_t height = terminal->Size().ws_row;
+  const size_t history_lines = terminal->HistoryLines();
+  std::vector<Terminal::CharacterType> result(history_lines * width);
+
+  Terminal::State state;
+  for (size_t scroll = 0; scroll < history_lines; scroll += height) {
+    terminal->history_scroll = scroll;
+    terminal->GetState(&state);
+
+    for (size_t row = 0; row < height; ++row) {
+      const size_t line = (history_lines - scroll + row) % history_lines;
+      std::copy(&state.chars[row * width], &state.chars[(row + 1) * width],
+                &result[line * width]);
+    }
+  }
+  terminal->history_scroll = 0;
+
+  return result;
+}
+
+// The text between `begin' and `end', with trailing blanks trimmed from
+// every line, and newlines after lines that do not fill the width.
+std::string ReferenceText(const std::vector<Terminal::CharacterType>& chars,
+                          size_t width, size_t begin, size_t end) {
+  if (begin > end) std::swap(begin, end);
+
+  size_t last_graph = 0;
+  size_t last_graph_col = 0;
+  std::string result;
+
+  for (size_t i = begin; i != end; ++i) {
+    int ch = chars[i % chars.size()];
+    if (ch == 0 || ch == 0xffff) ch = ' ';
+
+    if (i > begin && (i % width) == 0) {
+      result.resize(last_graph);
+      if (last_graph_col != (width - 1)) result.push_back('\n');
+      last_graph = result.size();
+    }
+
+    if (ch < 0x80) {
+      result.push_back(ch);
+    } else if (ch < 0x800) {
+      result.push_back(0xC0 | (ch >> 6));
+      result.push_back(0x80 | (ch & 0x3F));
+    } else if (ch < 0x10000) {
+      result.push_back(0xE0 | (ch >> 12));
+      result.push_back(0x80 | ((ch >> 6) & 0x3F));
+      result.push_back(0x80 | (ch & 0x3f));
+    }
+
+    if (ch != ' ') {
+      last_graph = result.size();
+      last_graph_col = i % width;
+    }
+  }
+
+  result.resize(last_graph);
+
+  return result;
+}
+
+void Test(bool history_file) {
+  Terminal terminal([](const void* data, size_t size) {});
+  terminal.Init(400, 300, 10, 20, 200);
+
+  if (history_file) {
+    const char* directory = getenv("TMPDIR");
+    if (!terminal.OpenHistoryFile(directory && *directory ? directory
+                                                          : "/tmp")) {
+      perror("OpenHistoryFile failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  std::string data;
+  for (size_t i = 0; i < 200000; ++i) {
+    switch (rand() % 24) {
+      case 0: data += "\r\n"; break;
+      case 1: data += "\033[" + std::to_string(rand() % 40) + "C"; break;
+      case 2: data += "\xc3\xa5"; break;
+      case 3: data += "\xe4\xb8\xad"; break;
+      case 4: data += "   "; break;
+      case 5:
+        data += "\033[" + std::to_string(rand() % 15) + ";" +
+                std::to_string(rand() % 40) + "H";
+        break;
+      case 6: data += "\033[1;3" + std::to_string(rand() % 8) + "m"; break;
+      case 7: data += "\033[K"; break;
+      default: data += 'a' + rand() % 26;
+    }
+  }
+  terminal.ProcessData(data.data(), data.size());
+
+  const size_t width = terminal.Size().ws_col;
+  const std::vector<Terminal::CharacterType> chars = ReadCharacters(&terminal);
+
+  for (size_t i = 0; i < 500; ++i) {
+    size_t begin = rand() % chars.size(), end = rand() % chars.size();
+    if (i % 3 == 0) end = begin + rand() % (width * 3);
+    if (i % 7 == 0) begin = end;
+
+    const std::string expected = ReferenceText(chars, width, begin, end);
+    assert(terminal.GetTextInRange(begin, end) == expected);
+
+    Terminal::TextRange range(std::min(begin, end), std::max(begin, end));
+    const size_t max_size = 1 + rand() % 200;
+    std::string text;
+    while (!range.empty()) terminal.ReadText(&range, max_size, &text);
+    assert(text == expected);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  srand(time(NULL));
+
+  Test(false);
+  Test(true);
+
+  return EXIT_SUCCESS;
+}
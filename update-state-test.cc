@@ -0,0 +1,150 @@
+// Checks that Terminal::UpdateState, applied to the same State over and over,
+// keeps giving what GetState gives, through random output, scrolling of the
+// view into the history, selection changes and resizing.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+#include "terminal.h"
+
+namespace {
+
+const size_t kHistorySize = 200;
+const size_t kStepCount = 5000;
+
+bool SameColor(const Terminal::Color& lhs, const Terminal::Color& rhs) {
+  return lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b;
+}
+
+bool SameAttr(const Terminal::Attr& lhs, const Terminal::Attr& rhs) {
+  return SameColor(lhs.fg, rhs.fg) && SameColor(lhs.bg, rhs.bg) &&
+         lhs.extra == rhs.extra;
+}
+
+void CheckState(const Terminal::State& state,
+                const Terminal::State& expected) {
+  assert(state.width == expected.width);
+  assert(state.height == expected.height);
+  assert(state.chars == expected.chars);
+  assert(state.attr.size() == expected.attr.size());
+  for (size_t i = 0; i < state.attr.size(); ++i)
+    assert(SameAttr(state.attr[i], expected.attr[i]));
+  assert(state.cursor_x == expected.cursor_x);
+  assert(state.cursor_y == expected.cursor_y);
+  assert(state.selection_begin == expected.selection_begin);
+  assert(state.selection_end == expected.selection_end);
+  assert(state.cursor_hidden == expected.cursor_hidden);
+  assert(state.generation == expected.generation);
+  assert(state.scroll_count == expected.scroll_count);
+  assert(state.history_scroll == expected.history_scroll);
+}
+
+// Returns a random piece of output: text, line feeds, and escape sequences
+// that move the cursor, edit the screen, scroll a region or switch screens.
+std::string GenerateOutput() {
+  std::string result;
+
+  for (size_t i = rand() % 40; i-- > 0;) {
+    switch (rand() % 24) {
+      case 0: result += "\r\n"; break;
+      case 1: result += "\n\n\n\n\n\n\n\n"; break;
+      case 2: result += "\033[" + std::to_string(rand() % 30) + "H"; break;
+      case 3: result += "\033[" + std::to_string(rand() % 30) + ";" +
+                        std::to_string(rand() % 100) + "H"; break;
+      case 4: result += "\033[K"; break;
+      case 5: result += "\033[2J"; break;
+      case 6: result += "\033[" + std::to_string(rand() % 5) + "L"; break;
+      case 7: result += "\033[" + std::to_string(rand() % 5) + "M"; break;
+      case 8: result += "\033M"; break;
+      case 9: result += "\033[" + std::to_string(1 + rand() % 10) + ";" +
+                        std::to_string(5 + rand() % 20) + "r"; break;
+      case 10: result += "\033[r"; break;
+      case 11: result += rand() % 2 ? "\033[?1049h" : "\033[?1049l"; break;
+      case 12: result += rand() % 2 ? "\033[?25h" : "\033[?25l"; break;
+      case 13: result += "\033[4" + std::to_string(rand() % 8) + "m"; break;
+      case 14: result += "\033[0m"; break;
+      case 15: result += "\xe4\xb8\xad\xce\xb1"; break;
+      default:
+        result.append(rand() % 100, 'a' + rand() % 26);
+        break;
+    }
+  }
+
+  return result;
+}
+
+void Test(bool history_file) {
+  Terminal terminal([](const void* data, size_t size) {});
+
+  // Distinct colors, so that a wrong attribute can not go unnoticed.
+  for (unsigned int i = 0; i < 256; ++i)
+    terminal.SetANSIColor(i, Terminal::Color(i, i * 3, i * 7));
+
+  terminal.Init(800, 480, 10, 20, kHistorySize);
+
+  if (history_file) {
+    const char* directory = getenv("TMPDIR");
+    if (!terminal.OpenHistoryFile(directory && *directory ? directory
+                                                          : "/tmp")) {
+      perror("OpenHistoryFile failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Kept across all steps, and only ever brought up to date by UpdateState.
+  Terminal::State state;
+  terminal.GetState(&state);
+
+  for (size_t step = 0; step < kStepCount; ++step) {
+    switch (rand() % 8) {
+      case 0:
+        // Mostly look at the screen itself, which UpdateState updates row
+        // by row, and sometimes into the history.
+        terminal.history_scroll =
+            rand() % 4 ? 0 : rand() % terminal.HistoryLines();
+        break;
+
+      case 1: {
+        const size_t cells = terminal.HistoryLines() * terminal.Size().ws_col;
+        terminal.select_begin = rand() % cells;
+        terminal.select_end = rand() % cells;
+      } break;
+
+      case 2:
+        if (rand() % 8 == 0) {
+          terminal.Resize(400 + rand() % 800, 200 + rand() % 400, 10, 20);
+          break;
+        }
+
+      // Fall through.
+
+      default: {
+        const std::string data = GenerateOutput();
+        terminal.ProcessData(data.data(), data.size());
+      } break;
+    }
+
+    // The view can not reach further back than the history goes.
+    if (terminal.history_scroll >= terminal.HistoryLines())
+      terminal.history_scroll = 0;
+
+    Terminal::State expected;
+    terminal.GetState(&expected);
+    terminal.UpdateState(&state);
+    CheckState(state, expected);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  srand(time(NULL));
+
+  Test(false);
+  Test(true);
+
+  return EXIT_SUCCESS;
+}
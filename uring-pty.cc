@@ -0,0 +1,411 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "uring-pty.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+namespace {
+
+#if HAVE_LINUX_IO_URING_H
+
+// IORING_OP_READ_MULTISHOT, from Linux 6.7, which is newer than the headers
+// on many systems.  Support for it is probed at run time.
+const uint8_t kOpReadMultishot = 49;
+
+// Only a read and a write are ever in flight.
+const unsigned kQueueEntries = 4;
+
+// Number and size of the buffers the multishot read fills.  The number must
+// be a power of two.  Reads from a pty return at most 4 KB, so many small
+// buffers go further than a few large ones before the read runs out.
+const unsigned kBufferCount = 64;
+const size_t kBufferSize = 16 << 10;
+
+// Room for a completion for every buffer, and for the writes.
+const unsigned kCompletionEntries = 2 * kBufferCount;
+const uint16_t kBufferGroup = 0;
+
+// Marks the completions of reads and writes.
+enum : uint64_t { kReadTag = 1, kWriteTag = 2, kPollTag = 3 };
+
+int Setup(unsigned entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int Enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+          unsigned flags, const void* arg, size_t arg_size) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 arg, arg_size);
+}
+
+int Register(int ring_fd, unsigned opcode, const void* arg, unsigned count) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, count);
+}
+
+template <typename T>
+T* RingField(void* ring, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+#endif  // HAVE_LINUX_IO_URING_H
+
+}  // namespace
+
+URingPty::URingPty()
+    : ring_fd_(-1),
+      fd_(-1),
+      rings_(),
+      rings_size_(),
+      sqes_(),
+      sqes_size_(),
+      sq_head_(),
+      sq_tail_(),
+      sq_mask_(),
+      sq_array_(),
+      pending_sqes_(),
+      cq_head_(),
+      cq_tail_(),
+      cq_mask_(),
+      cqes_(),
+      buffer_ring_(),
+      buffer_ring_size_(),
+      buffer_tail_(),
+      write_offset_(),
+      write_failed_(),
+      queued_bytes_(),
+      system_calls_() {}
+
+URingPty::~URingPty() {
+  // Closing the ring cancels the requests in flight, so the memory they use
+  // can be unmapped afterwards.
+  if (ring_fd_ != -1) close(ring_fd_);
+  if (buffer_ring_) munmap(buffer_ring_, buffer_ring_size_);
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (rings_) munmap(rings_, rings_size_);
+}
+
+#if HAVE_LINUX_IO_URING_H
+
+bool URingPty::Open(int fd) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = kCompletionEntries;
+
+  int ring_fd = Setup(kQueueEntries, &params);
+  if (ring_fd == -1) return false;
+
+  // Features used below, other than the multishot read, which is probed.
+  const uint32_t kFeatures = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+  if ((params.features & kFeatures) != kFeatures) {
+    close(ring_fd);
+    errno = ENOSYS;
+    return false;
+  }
+
+  ring_fd_ = ring_fd;
+  fd_ = fd;
+
+  if (!Map(params)) {
+    const int saved_errno = errno;
+    close(ring_fd_);
+    ring_fd_ = -1;
+    errno = saved_errno;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  SubmitRead();
+
+  return true;
+}
+
+bool URingPty::Map(const io_uring_params& params) {
+  const size_t probe_size =
+      sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+  std::unique_ptr<char[]> probe_data(new char[probe_size]());
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_data.get());
+  if (-1 == Register(ring_fd_, IORING_REGISTER_PROBE, probe, 256))
+    return false;
+  if (probe->last_op < kOpReadMultishot ||
+      !(probe->ops[kOpReadMultishot].flags & IO_URING_OP_SUPPORTED)) {
+    errno = ENOSYS;
+    return false;
+  }
+
+  rings_size_ =
+      std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  void* rings = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) return false;
+  rings_ = rings;
+
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_head_ = RingField<unsigned>(rings_, params.sq_off.head);
+  sq_tail_ = RingField<unsigned>(rings_, params.sq_off.tail);
+  sq_mask_ = *RingField<unsigned>(rings_, params.sq_off.ring_mask);
+  sq_array_ = RingField<unsigned>(rings_, params.sq_off.array);
+
+  cq_head_ = RingField<unsigned>(rings_, params.cq_off.head);
+  cq_tail_ = RingField<unsigned>(rings_, params.cq_off.tail);
+  cq_mask_ = *RingField<unsigned>(rings_, params.cq_off.ring_mask);
+  cqes_ = RingField<io_uring_cqe>(rings_, params.cq_off.cqes);
+
+  buffer_ring_size_ = kBufferCount * sizeof(io_uring_buf);
+  void* buffer_ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer_ring == MAP_FAILED) return false;
+  buffer_ring_ = static_cast<io_uring_buf_ring*>(buffer_ring);
+
+  io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = reinterpret_cast<uintptr_t>(buffer_ring_);
+  registration.ring_entries = kBufferCount;
+  registration.bgid = kBufferGroup;
+  if (-1 == Register(ring_fd_, IORING_REGISTER_PBUF_RING, &registration, 1))
+    return false;
+
+  buffers_.reset(new unsigned char[kBufferCount * kBufferSize]);
+  for (uint16_t i = 0; i < kBufferCount; ++i) RecycleBuffer(i);
+
+  return true;
+}
+
+ssize_t URingPty::Read(
+    int timeout,
+    const std::function<void(const iovec*, size_t)>& process) {
+  unsigned head = *cq_head_;
+
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000LL;
+      arg.ts = reinterpret_cast<uintptr_t>(&ts);
+    }
+
+    ++system_calls_;
+    if (-1 == Enter(ring_fd_, 0, 1,
+                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                    sizeof(arg))) {
+      if (errno == ETIME || errno == EINTR) return 0;
+      return -1;
+    }
+  }
+
+  ssize_t total = 0;
+  bool closed = false;
+  bool rearm = false;
+
+  // Buffers read, which are handed back once `process' is done with them.
+  iovec buffers[kBufferCount];
+  uint16_t indexes[kBufferCount];
+  size_t count = 0;
+
+  for (unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+       head != tail; ++head) {
+    const io_uring_cqe cqe = cqes_[head & cq_mask_];
+
+    if (cqe.user_data == kWriteTag) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!CompleteWrite(cqe)) closed = true;
+      }
+      if (on_write_) on_write_(queued_bytes_);
+      continue;
+    }
+
+    if (cqe.user_data == kPollTag) continue;
+
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      const uint16_t index = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe.res > 0) {
+        buffers[count].iov_base = &buffers_[index * kBufferSize];
+        buffers[count].iov_len = cqe.res;
+        indexes[count++] = index;
+        total += cqe.res;
+      } else {
+        RecycleBuffer(index);
+      }
+    }
+
+    // Running out of buffers ends the multishot read, but they have been
+    // handed back by now.  Anything else ending it means the pty is closed.
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      if (cqe.res > 0 || cqe.res == -ENOBUFS)
+        rearm = true;
+      else
+        closed = true;
+    }
+  }
+
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+  if (count) {
+    process(buffers, count);
+    for (size_t i = 0; i < count; ++i) RecycleBuffer(indexes[i]);
+  }
+
+  if (closed) return -1;
+
+  if (rearm) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SubmitRead();
+  }
+
+  return total;
+}
+
+void URingPty::Write(const void* data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (write_failed_ || !size) return;
+
+  queued_bytes_ += size;
+
+  if (write_offset_ < writing_.size()) {
+    queued_.append(static_cast<const char*>(data), size);
+    return;
+  }
+
+  writing_.assign(static_cast<const char*>(data), size);
+  write_offset_ = 0;
+  SubmitWrite(false);
+}
+
+void URingPty::SubmitRead() {
+  io_uring_sqe* sqe = GetSQE();
+  sqe->opcode = kOpReadMultishot;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->fd = fd_;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = kReadTag;
+  Submit();
+}
+
+void URingPty::SubmitWrite(bool wait_writable) {
+  // The pty is non-blocking, so the write alone would fail with EAGAIN
+  // rather than wait for room.
+  if (wait_writable) {
+    io_uring_sqe* sqe = GetSQE();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = fd_;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = kPollTag;
+  }
+
+  io_uring_sqe* sqe = GetSQE();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd_;
+  sqe->addr = reinterpret_cast<uintptr_t>(&writing_[write_offset_]);
+  sqe->len = writing_.size() - write_offset_;
+  sqe->off = -1;
+  sqe->user_data = kWriteTag;
+  Submit();
+}
+
+io_uring_sqe* URingPty::GetSQE() {
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & sq_mask_;
+
+  io_uring_sqe* sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++pending_sqes_;
+
+  return sqe;
+}
+
+void URingPty::Submit() {
+  while (pending_sqes_) {
+    ++system_calls_;
+    const int result = Enter(ring_fd_, pending_sqes_, 0, 0, nullptr, 0);
+    if (result == -1) {
+      if (errno == EINTR) continue;
+      // The entries stay queued, and go with the next submission.
+      return;
+    }
+    pending_sqes_ -= result;
+  }
+}
+
+void URingPty::RecycleBuffer(uint16_t index) {
+  // The buffers overlay the ring header, but C++ puts an empty struct in
+  // front of `bufs' in the kernel headers, so they are indexed from the
+  // start of the ring instead.
+  io_uring_buf& buffer = reinterpret_cast<io_uring_buf*>(
+      buffer_ring_)[buffer_tail_ & (kBufferCount - 1)];
+  buffer.addr = reinterpret_cast<uintptr_t>(&buffers_[index * kBufferSize]);
+  buffer.len = kBufferSize;
+  buffer.bid = index;
+  __atomic_store_n(&buffer_ring_->tail, ++buffer_tail_, __ATOMIC_RELEASE);
+}
+
+bool URingPty::CompleteWrite(const io_uring_cqe& cqe) {
+  // A write cancelled along with a failed poll is tried again.
+  if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR &&
+      cqe.res != -ECANCELED) {
+    write_failed_ = true;
+    writing_.clear();
+    queued_.clear();
+    write_offset_ = 0;
+    queued_bytes_ = 0;
+    return false;
+  }
+
+  if (cqe.res > 0) {
+    write_offset_ += cqe.res;
+    queued_bytes_ -= cqe.res;
+  }
+
+  if (write_offset_ == writing_.size()) {
+    writing_.clear();
+    write_offset_ = 0;
+    if (queued_.empty()) return true;
+    writing_.swap(queued_);
+  }
+
+  SubmitWrite(cqe.res < 0 || write_offset_ > 0);
+
+  return true;
+}
+
+#else  // !HAVE_LINUX_IO_URING_H
+
+bool URingPty::Open(int fd) {
+  errno = ENOSYS;
+  return false;
+}
+
+ssize_t URingPty::Read(
+    int timeout,
+    const std::function<void(const iovec*, size_t)>& process) {
+  return -1;
+}
+
+void URingPty::Write(const void* data, size_t size) {}
+
+#endif  // !HAVE_LINUX_IO_URING_H
@@ -0,0 +1,139 @@
+#ifndef URING_PTY_H_
+#define URING_PTY_H_ 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_params;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// Reads and writes a pty through io_uring.  A multishot read stays queued in
+// the kernel and fills buffers the ring provides, so output is received
+// without a poll and read system call pair for every wakeup, and writes are
+// queued without blocking the caller.
+class URingPty {
+ public:
+  URingPty();
+  ~URingPty();
+
+  URingPty(const URingPty&) = delete;
+  URingPty& operator=(const URingPty&) = delete;
+
+  // Starts reading from `fd', which must be non-blocking; a blocking pty
+  // does not end the multishot read when it is hung up.  Returns false and
+  // sets errno if io_uring, or one of the features used, is not available, in
+  // which case the caller should fall back to poll and read.
+  bool Open(int fd);
+
+  bool IsOpen() const { return ring_fd_ != -1; }
+
+  // Waits up to `timeout' milliseconds, or forever if it is negative, for
+  // output, and passes everything read since the last call to `process' at
+  // once, as `count' buffers in order.  Pty reads rarely return more than a
+  // few kilobytes each, so this lets the caller handle a burst of output in
+  // one go.  Returns the number of bytes read, 0 if the wait timed out, or -1
+  // if the pty was closed or failed.
+  ssize_t Read(int timeout,
+               const std::function<void(const iovec* buffers, size_t count)>&
+                   process);
+
+  // Queues `data' to be written.  Data queued while an earlier write is in
+  // progress is sent in a single write when it completes.  May be called from
+  // any thread.
+  void Write(const void* data, size_t size);
+
+  // Sets a function for Read to call after every completed write, with the
+  // number of bytes still queued.  Must be called before Open.
+  void SetWriteCallback(std::function<void(size_t)> on_write) {
+    on_write_ = std::move(on_write);
+  }
+
+  // Number of bytes written but not yet accepted by the pty.
+  size_t Queued() const { return queued_bytes_; }
+
+  // Number of system calls made, for benchmarking.
+  uint64_t SystemCalls() const { return system_calls_; }
+
+ private:
+  // Checks that the multishot read is supported, and maps the rings of
+  // `ring_fd_'.  Returns false and sets errno on failure.
+  bool Map(const io_uring_params& params);
+
+  // Queues a multishot read.  Must be called with `mutex_' held.
+  void SubmitRead();
+
+  // Queues a write of the rest of `writing_', after waiting for the pty to
+  // become writable if `wait_writable' is true.  Must be called with
+  // `mutex_' held.
+  void SubmitWrite(bool wait_writable);
+
+  // Returns the next free submission queue entry, cleared.  Must be called
+  // with `mutex_' held.
+  io_uring_sqe* GetSQE();
+
+  // Submits the entries returned by GetSQE.  Must be called with `mutex_'
+  // held.
+  void Submit();
+
+  // Hands buffer `index' back to the kernel.
+  void RecycleBuffer(uint16_t index);
+
+  // Handles the completion of a write.  Returns false if it failed.  Must be
+  // called with `mutex_' held.
+  bool CompleteWrite(const io_uring_cqe& cqe);
+
+  int ring_fd_;
+  int fd_;
+
+  void* rings_;
+  size_t rings_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned pending_sqes_;
+
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  // Buffers the kernel picks from for the multishot read.
+  io_uring_buf_ring* buffer_ring_;
+  size_t buffer_ring_size_;
+  std::unique_ptr<unsigned char[]> buffers_;
+  uint16_t buffer_tail_;
+
+  // Protects the submission queue and the write state, since Write is called
+  // from other threads than Read.
+  std::mutex mutex_;
+
+  // Data being written, of which the first `write_offset_' bytes are done,
+  // and data queued behind it.
+  std::string writing_;
+  size_t write_offset_;
+  std::string queued_;
+  bool write_failed_;
+
+  // All of the above that is not yet written.
+  std::atomic<size_t> queued_bytes_;
+  std::function<void(size_t)> on_write_;
+
+  std::atomic<uint64_t> system_calls_;
+};
+
+#endif  // !URING_PTY_H_
@@ -25,6 +25,8 @@ unsigned int X11_window_height = 600;
 Atom xa_utf8_string;
 Atom xa_clipboard;
 Atom xa_targets;
+Atom xa_incr;
+Atom xa_input_ready;
 
 static Bool x11_WaitForMapNotify(Display* X11_display, XEvent* event,
                                  char* arg) {
@@ -76,7 +78,7 @@ void X11_Setup(void) {
   attr.event_mask =
       ExposureMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
       KeyPressMask | KeyReleaseMask | FocusChangeMask | EnterWindowMask |
-      LeaveWindowMask | StructureNotifyMask;
+      LeaveWindowMask | StructureNotifyMask | PropertyChangeMask;
 
   X11_window = XCreateWindow(
       X11_display, RootWindow(X11_display, X11_visual->screen), 0, 0,
@@ -117,6 +119,8 @@ void X11_Setup(void) {
   xa_utf8_string = XInternAtom(X11_display, "UTF8_STRING", False);
   xa_clipboard = XInternAtom(X11_display, "CLIPBOARD", False);
   xa_targets = XInternAtom(X11_display, "TARGETS", False);
+  xa_incr = XInternAtom(X11_display, "INCR", False);
+  xa_input_ready = XInternAtom(X11_display, "_CANTERA_INPUT_READY", False);
 
   XSynchronize(X11_display, False);
 }
@@ -21,6 +21,11 @@ extern unsigned int X11_window_height;
 extern Atom xa_utf8_string;
 extern Atom xa_clipboard;
 extern Atom xa_targets;
+extern Atom xa_incr;
+
+/* Sent to our own window when there is room for more input in the pty write
+ * queue.  */
+extern Atom xa_input_ready;
 
 void X11_Setup(void);
 